@@ -0,0 +1,26 @@
+/*
+	Single-block AES-128 encryption, as used to resolve private Bluetooth addresses.
+
+	ESP32 builds go through mbedtls, which uses the hardware AES engine. Other builds (the host
+	benchmark and soak tests under test/) use a plain software implementation.
+*/
+#ifndef AES_SHIM_H
+#define AES_SHIM_H
+
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "mbedtls/aes.h"
+typedef mbedtls_aes_context AesContext;
+#else
+struct AesContext {
+	uint8_t roundKeys[176];
+};
+#endif
+
+void aesInit(AesContext* ctx);
+void aesSetKey(AesContext* ctx, const uint8_t key[16]);
+void aesEncrypt(AesContext* ctx, const uint8_t input[16], uint8_t output[16]);
+void aesFree(AesContext* ctx);
+
+#endif
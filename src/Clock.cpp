@@ -0,0 +1,73 @@
+#include "Clock.h"
+#include <stdlib.h>
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+volatile bool clockSynced = false;
+static int64_t clockOffset = 0;
+static int64_t lastClockSync = -1;
+static portMUX_TYPE clockMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Reads the wall clock and esp_timer as close together as possible. gettimeofday takes a lock, so it can't be
+// wrapped in a critical section; instead esp_timer is read on both sides and the read retried if a task switch
+// or interrupt landed in between.
+static bool readClocks(struct timeval* now, int64_t* monotonic) {
+	for (int attempt = 0; attempt < 5; attempt++) {
+		int64_t before = esp_timer_get_time();
+		gettimeofday(now, NULL);
+		int64_t after = esp_timer_get_time();
+		if (after - before < 50) {
+			*monotonic = before + (after - before) / 2;
+			return true;
+		}
+	}
+	return false;
+}
+
+void updateClockOffset() {
+	struct timeval now;
+	int64_t monotonic;
+	if (!readClocks(&now, &monotonic) || now.tv_sec < 1600000000) {
+		return; // Busy, or SNTP has not set the clock yet
+	}
+	int64_t offset = (int64_t)now.tv_sec * 1000000LL + now.tv_usec - monotonic;
+	portENTER_CRITICAL(&clockMux);
+#ifndef HAVE_SNTP_SYNC_CALLBACK
+	// Without a sync callback, a sync is detected as a step in the offset: both clocks run from the same
+	// crystal, so it only moves when SNTP sets the wall clock. Corrections under 1 ms go unnoticed
+	if (!clockSynced || llabs(offset - clockOffset) > 1000) {
+		lastClockSync = monotonic;
+	}
+#endif
+	clockOffset = offset;
+	clockSynced = true;
+	portEXIT_CRITICAL(&clockMux);
+}
+
+#ifdef HAVE_SNTP_SYNC_CALLBACK
+void onTimeSync(struct timeval* tv) {
+	updateClockOffset();
+	int64_t syncedAt = esp_timer_get_time();
+	portENTER_CRITICAL(&clockMux);
+	lastClockSync = syncedAt;
+	portEXIT_CRITICAL(&clockMux);
+}
+#endif
+
+ClockState getClockState() {
+	ClockState state;
+	portENTER_CRITICAL(&clockMux);
+	state.synced = clockSynced;
+	state.offset = clockOffset;
+	state.lastSync = lastClockSync;
+	portEXIT_CRITICAL(&clockMux);
+	return state;
+}
+
+int64_t epochMillis(int64_t monotonic) {
+	ClockState state = getClockState();
+	if (!state.synced) {
+		return 0;
+	}
+	return (monotonic + state.offset) / 1000;
+}
@@ -0,0 +1,33 @@
+/*
+	Wall clock time for reports, kept as an offset from esp_timer so that timestamps captured
+	when an advertisement arrives stay valid however long the report takes to publish.
+*/
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+#include <sys/time.h>
+#if __has_include("esp_sntp.h")
+#include "esp_sntp.h"
+#define HAVE_SNTP_SYNC_CALLBACK
+#endif
+
+// SNTP updates the clock from its own task, so the 64-bit fields are read together under a lock
+struct ClockState {
+	bool synced;
+	int64_t offset; // Microseconds to add to esp_timer_get_time() to get the wall clock time
+	int64_t lastSync; // esp_timer_get_time() at the last SNTP sync, or -1 if none has been seen
+};
+
+extern volatile bool clockSynced;
+
+ClockState getClockState();
+
+void updateClockOffset();
+#ifdef HAVE_SNTP_SYNC_CALLBACK
+void onTimeSync(struct timeval* tv);
+#endif
+// Milliseconds since the epoch for a value of esp_timer_get_time(), or 0 if the clock has never been synced
+int64_t epochMillis(int64_t monotonic);
+
+#endif
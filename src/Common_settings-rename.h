@@ -40,3 +40,20 @@
 
 // Maximum distance (in meters) to report. Devices that are calculated to be further than this distance in meters will not be reported
 #define maxDistance 5
+
+// Identity Resolving Keys for devices that rotate their address (most iPhones and modern Android phones).
+// Each entry is the id to report for the device and its IRK as 32 hex characters, most significant byte first (up to 64 entries).
+// Uncomment to enable; example: #define irkList { {"my-phone", "00112233445566778899aabbccddeeff"} }
+//#define irkList { {"my-phone", "00112233445566778899aabbccddeeff"} }
+
+// NTP server used to timestamp reports. Defaults to "pool.ntp.org"; example: #define ntpServer "192.168.1.1"
+//#define ntpServer "pool.ntp.org"
+
+// Scan parameters used while a firmware update is downloading. Shorter, less frequent scans leave more airtime for the transfer
+//#define otaScanTime 2 // Duration of a single scan in seconds during an update
+//#define otaScanInterval 10 // Interval in seconds between scans during an update
+
+// Topic for firmware updates by URL; publishing "<http:// URL of a .bin or .bin.gz image> <SHA-256 of the .bin>" (not retained) installs it.
+// The download is plain HTTP and anyone who can publish to this topic can flash the node, so only enable it on a broker with
+// per-client ACLs; the SHA-256 only protects against an image being swapped or corrupted in transit. Uncomment to enable
+//#define otaTopic "presence_nodes/ota/" room "_" instance
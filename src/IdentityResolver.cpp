@@ -0,0 +1,125 @@
+#include "IdentityResolver.h"
+#include "AesShim.h"
+#include <string.h>
+
+static const int8_t pendingIdentity = -2;
+
+IdentityResolver identityResolver;
+
+static int hexNibble(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+IdentityResolver::IdentityResolver() : keyCount(0), useCounter(0), cacheHits(0) {
+	clearCache();
+}
+
+bool IdentityResolver::addKey(const char* id, const char* irk) {
+	if (keyCount >= maxIdentityKeys || strlen(irk) != 32) {
+		return false;
+	}
+	IdentityKey* key = &keys[keyCount];
+	for (int i = 0; i < 16; i++) {
+		int hi = hexNibble(irk[i * 2]);
+		int lo = hexNibble(irk[i * 2 + 1]);
+		if (hi < 0 || lo < 0) {
+			return false;
+		}
+		key->irk[i] = (hi << 4) | lo;
+	}
+	key->id = id;
+	keyCount++;
+	clearCache(); // Cached misses may match the new key
+	return true;
+}
+
+void IdentityResolver::clearCache() {
+	memset(cache, 0, sizeof(cache));
+	useCounter = 0;
+}
+
+bool IdentityResolver::isResolvablePrivateAddress(const ScannedAddress& scanned) {
+	// The two most significant bits of a resolvable private address are 0b01; public addresses can look the same
+	return scanned.random && (scanned.address[0] & 0xC0) == 0x40;
+}
+
+// Stores the result in a free entry, or in place of the least recently used one
+void IdentityResolver::cacheResult(const ScannedAddress& scanned) {
+	CacheEntry* entry = &cache[0];
+	for (int c = 0; c < rpaCacheSize && entry->used; c++) {
+		if (!cache[c].used || cache[c].lastUsed < entry->lastUsed) {
+			entry = &cache[c];
+		}
+	}
+	memcpy(entry->address, scanned.address, ESP_BD_ADDR_LEN);
+	entry->identity = scanned.identity;
+	entry->used = true;
+	entry->lastUsed = ++useCounter;
+}
+
+int IdentityResolver::resolve(ScannedAddress* addresses, int count) {
+	int pendingCount = 0;
+	int resolved = 0;
+	cacheHits = 0;
+
+	for (int i = 0; i < count; i++) {
+		ScannedAddress* scanned = &addresses[i];
+		scanned->identity = -1;
+		if (keyCount == 0 || !isResolvablePrivateAddress(*scanned)) continue;
+
+		scanned->identity = pendingIdentity;
+		for (int c = 0; c < rpaCacheSize; c++) {
+			if (cache[c].used && memcmp(cache[c].address, scanned->address, ESP_BD_ADDR_LEN) == 0) {
+				scanned->identity = cache[c].identity;
+				cache[c].lastUsed = ++useCounter;
+				cacheHits++;
+				break;
+			}
+		}
+		if (scanned->identity == pendingIdentity) {
+			pendingCount++;
+		} else if (scanned->identity >= 0) {
+			resolved++;
+		}
+	}
+	if (pendingCount == 0) {
+		return resolved;
+	}
+
+	// Key-major order: the key schedule is set up once per key for the software AES. The ESP32's mbedtls
+	// port writes the key to the AES hardware on every block, so there it only saves the context setup
+	AesContext aes;
+	aesInit(&aes);
+	for (int k = 0; k < keyCount && pendingCount > 0; k++) {
+		aesSetKey(&aes, keys[k].irk);
+		for (int i = 0; i < count; i++) {
+			ScannedAddress* scanned = &addresses[i];
+			if (scanned->identity != pendingIdentity) continue;
+
+			// ah(k, r) = e(k, padding || prand); the address carries prand in its top 24 bits and the hash in its bottom 24
+			uint8_t plaintext[16] = {0};
+			uint8_t ciphertext[16];
+			memcpy(&plaintext[13], scanned->address, 3);
+			aesEncrypt(&aes, plaintext, ciphertext);
+			if (memcmp(&ciphertext[13], &scanned->address[3], 3) == 0) {
+				scanned->identity = k;
+				cacheResult(*scanned);
+				pendingCount--;
+				resolved++;
+			}
+		}
+	}
+	aesFree(&aes);
+
+	// Cache misses as well as matches, so unknown phones don't cost a full key sweep every scan
+	for (int i = 0; i < count; i++) {
+		if (addresses[i].identity == pendingIdentity) {
+			addresses[i].identity = -1;
+			cacheResult(addresses[i]);
+		}
+	}
+	return resolved;
+}
@@ -0,0 +1,65 @@
+/*
+	Resolves Bluetooth resolvable private addresses (used by most phones, which rotate their
+	address every ~15 minutes) back to a configured identity, using its Identity Resolving Key.
+*/
+#ifndef IDENTITY_RESOLVER_H
+#define IDENTITY_RESOLVER_H
+
+#include <stdint.h>
+#include "esp_bt_defs.h"
+
+static const int maxIdentityKeys = 64;
+static const int maxScanAddresses = 128; // Addresses beyond this per scan are reported without identity resolution
+static const int rpaCacheSize = 2 * maxScanAddresses; // Room for two full scans, so a busy scan doesn't evict its own addresses
+
+// Identities are stored as int8_t indexes, with -1 for unresolved addresses
+static_assert(maxIdentityKeys <= 127, "maxIdentityKeys must fit in an int8_t");
+
+struct ScannedAddress {
+	uint8_t address[ESP_BD_ADDR_LEN];
+	bool random; // Advertised with a random (rather than public) address type
+	int8_t identity; // Index of the matching key, or -1 if the address was not resolved
+	int64_t seenAt; // esp_timer_get_time() when the advertisement was received
+};
+
+class IdentityResolver {
+public:
+	IdentityResolver();
+
+	// Adds a key given as 32 hex characters, most significant byte first. Returns false if it can't be parsed
+	bool addKey(const char* id, const char* irk);
+	int getKeyCount() { return keyCount; }
+	const char* getId(int identity) { return keys[identity].id; }
+
+	// Sets the identity of every address in the batch, checking addresses that miss the cache key by key.
+	// Returns the number of addresses resolved to an identity
+	int resolve(ScannedAddress* addresses, int count);
+	int getCacheHits() { return cacheHits; }
+	void clearCache();
+
+	static bool isResolvablePrivateAddress(const ScannedAddress& scanned);
+
+private:
+	struct IdentityKey {
+		const char* id;
+		uint8_t irk[16];
+	};
+	struct CacheEntry {
+		uint8_t address[ESP_BD_ADDR_LEN];
+		int8_t identity;
+		bool used;
+		uint32_t lastUsed; // Value of useCounter when the entry was last stored or hit
+	};
+
+	void cacheResult(const ScannedAddress& scanned);
+
+	IdentityKey keys[maxIdentityKeys];
+	int keyCount;
+	CacheEntry cache[rpaCacheSize];
+	uint32_t useCounter;
+	int cacheHits;
+};
+
+extern IdentityResolver identityResolver;
+
+#endif
@@ -0,0 +1,372 @@
+#include <Arduino.h>
+#define ARDUINOJSON_USE_LONG_LONG 1
+#include <ArduinoJson.h>
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "BLEEddystoneTLM.h"
+#include "BLEEddystoneURL.h"
+#include "Clock.h"
+#include "Report.h"
+#include "Common_settings.h"
+#include "Settings.h"
+
+static const int scanTime = singleScanTime;
+static const int waitTime = scanInterval;
+static const uint16_t beaconUUID = 0xFEAA;
+#ifdef TxDefault
+static const int defaultTxPower = TxDefault;
+#else
+static const int defaultTxPower = -72;
+#endif
+#define ENDIAN_CHANGE_U16(x) ((((x)&0xFF00)>>8) + (((x)&0xFF)<<8))
+
+char localIp[16] = "";
+ScannedAddress scannedAddresses[maxScanAddresses];
+volatile int scannedAddressCount = 0;
+long lastUpdateDuration = -1;
+long lastUpdateGap = -1;
+
+void recordScannedAddress(BLEAdvertisedDevice& advertisedDevice) {
+	int64_t seenAt = esp_timer_get_time();
+	BLEAddress address = advertisedDevice.getAddress();
+	int index = scannedAddressCount;
+	if (index < maxScanAddresses && !findScannedAddress(*address.getNative())) {
+		memcpy(scannedAddresses[index].address, *address.getNative(), ESP_BD_ADDR_LEN);
+		scannedAddresses[index].random = advertisedDevice.getAddressType() == BLE_ADDR_TYPE_RANDOM;
+		scannedAddresses[index].identity = -1;
+		scannedAddresses[index].seenAt = seenAt;
+		scannedAddressCount = index + 1;
+	}
+}
+
+ScannedAddress* findScannedAddress(const uint8_t* address) {
+	for (int i = 0; i < scannedAddressCount; i++) {
+		if (memcmp(scannedAddresses[i].address, address, ESP_BD_ADDR_LEN) == 0) {
+			return &scannedAddresses[i];
+		}
+	}
+	return NULL;
+}
+
+void formatMacAddress(const uint8_t* address, char* mac) {
+	snprintf(mac, 13, "%02x%02x%02x%02x%02x%02x", address[0], address[1], address[2], address[3], address[4], address[5]);
+}
+
+// Writes the proximity UUID, byte order reversed and without dashes, into uuid (at least 33 chars)
+void getProximityUUIDString(BLEBeacon& beacon, char* uuid) {
+  std::string serviceData = beacon.getProximityUUID().toString();
+  int serviceDataLength = serviceData.length();
+  int length = 0;
+  int i = serviceDataLength;
+  while (i > 1 && length < 32)
+  {
+    if (serviceData[i-1] == '-') {
+      i--;
+    }
+    char a = serviceData[i-1];
+    char b = serviceData[i-2];
+    uuid[length++] = b;
+    uuid[length++] = a;
+
+    i -= 2;
+  }
+  uuid[length] = '\0';
+}
+
+float calculateDistance(int rssi, int txPower) {
+
+	float distFl;
+
+  if (rssi == 0) {
+      return -1.0;
+  }
+
+  if (!txPower) {
+      // somewhat reasonable default value
+      txPower = defaultTxPower;
+  }
+
+	if (txPower > 0) {
+		txPower = txPower * -1;
+	}
+
+  const float ratio = rssi * 1.0 / txPower;
+  if (ratio < 1.0) {
+      distFl = pow(ratio, 10);
+  } else {
+      distFl = (0.89976) * pow(ratio, 7.7095) + 0.111;
+  }
+
+	return round(distFl * 100) / 100;
+
+}
+
+bool buildReport(BLEAdvertisedDevice& advertisedDevice, char* buffer, size_t size, float& distance) {
+
+	StaticJsonDocument<500> doc;
+	distance = NAN; // Stays unset for Eddystone frames, which are then not reported
+
+	BLEAddress address = advertisedDevice.getAddress();
+	uint8_t* native = *address.getNative();
+	char mac_address[13];
+	formatMacAddress(native, mac_address);
+	char proximityUUID[33];
+	char beaconId[48];
+	int rssi = advertisedDevice.getRSSI();
+
+	doc["id"] = mac_address;
+	doc["uuid"] = mac_address;
+	doc["rssi"] = rssi;
+
+	ScannedAddress* scanned = findScannedAddress(native);
+	if (scanned && clockSynced) {
+		doc["ts"] = epochMillis(scanned->seenAt);
+	}
+	if (scanned && scanned->identity >= 0) {
+		doc["id"] = identityResolver.getId(scanned->identity);
+	}
+
+	if (advertisedDevice.haveName()){
+		String nameBLE = String(advertisedDevice.getName().c_str());
+		doc["name"] = nameBLE;
+	}
+
+	std::string strServiceData = advertisedDevice.getServiceData();
+	uint8_t cServiceData[100] = {0};
+	strServiceData.copy((char *)cServiceData, sizeof(cServiceData), 0);
+
+	if (advertisedDevice.getServiceDataUUID().equals(BLEUUID(beaconUUID))==true) {  // found Eddystone UUID
+		if (cServiceData[0]==0x10) {
+			BLEEddystoneURL oBeacon = BLEEddystoneURL();
+			oBeacon.setData(strServiceData);
+			doc["url"] = oBeacon.getDecodedURL();
+		} else if (cServiceData[0]==0x20) {
+			BLEEddystoneTLM oBeacon = BLEEddystoneTLM();
+			oBeacon.setData(strServiceData);
+		}
+	} else if (advertisedDevice.haveManufacturerData()==true) {
+		std::string strManufacturerData = advertisedDevice.getManufacturerData();
+
+		uint8_t cManufacturerData[100] = {0};
+		strManufacturerData.copy((char *)cManufacturerData, sizeof(cManufacturerData), 0);
+
+		if (strManufacturerData.length()==25 && cManufacturerData[0] == 0x4C  && cManufacturerData[1] == 0x00 ) {
+			BLEBeacon oBeacon = BLEBeacon();
+			oBeacon.setData(strManufacturerData);
+
+			getProximityUUIDString(oBeacon, proximityUUID);
+
+			distance = calculateDistance(rssi, oBeacon.getSignalPower());
+
+			int major = ENDIAN_CHANGE_U16(oBeacon.getMajor());
+			int minor = ENDIAN_CHANGE_U16(oBeacon.getMinor());
+
+			doc["major"] = major;
+			doc["minor"] = minor;
+
+			doc["uuid"] = proximityUUID;
+			snprintf(beaconId, sizeof(beaconId), "%s-%d-%d", proximityUUID, major, minor);
+			doc["id"] = beaconId;
+			doc["txPower"] = oBeacon.getSignalPower();
+			doc["distance"] = distance;
+
+		} else {
+
+			if (advertisedDevice.haveTXPower()) {
+				distance = calculateDistance(rssi, advertisedDevice.getTXPower());
+				doc["txPower"] = advertisedDevice.getTXPower();
+			} else {
+				distance = calculateDistance(rssi, defaultTxPower);
+			}
+
+			doc["distance"] = distance;
+
+			// TODO: parse manufacturer data
+
+		}
+	} else {
+
+		if (advertisedDevice.haveTXPower()) {
+			distance = calculateDistance(rssi, advertisedDevice.getTXPower());
+			doc["txPower"] = advertisedDevice.getTXPower();
+			doc["distance"] = distance;
+		} else {
+			distance = calculateDistance(rssi, defaultTxPower);
+			doc["distance"] = distance;
+		}
+	}
+
+	if (doc.overflowed() || measureJson(doc) >= size) {
+		return false;
+	}
+	serializeJson(doc, buffer, size);
+	return true;
+}
+
+bool buildTelemetry(char* buffer, size_t size, const char* ip, int stackFree, int deviceCount, int reportCount, int voltage, int loopCount, int powerOn) {
+	// One slot per member below; strings are literals or const char* and are not copied into the document
+	StaticJsonDocument<JSON_OBJECT_SIZE(22)> tele;
+	tele["room"] = room;
+	tele["ip"] = ip;
+	tele["hostname"] = hostname;
+	tele["scan_dur"] = scanTime;
+	tele["wait_dur"] = waitTime;
+	tele["max_dist"] = maxDistance;
+
+	updateClockOffset();
+	ClockState clock = getClockState();
+	if (clock.synced) {
+		int64_t now = esp_timer_get_time();
+		tele["ts"] = (now + clock.offset) / 1000;
+		tele["clk_off"] = clock.offset / 1000;
+		if (clock.lastSync >= 0) {
+			tele["sync_age"] = (long)((now - clock.lastSync) / 1000000);
+		}
+	}
+
+	if (lastUpdateDuration > -1) {
+		tele["ota_dur"] = lastUpdateDuration;
+		tele["ota_gap"] = lastUpdateGap;
+	}
+
+	multi_heap_info_t heap;
+	heap_caps_get_info(&heap, MALLOC_CAP_8BIT);
+	tele["free_heap"] = heap.total_free_bytes;
+	tele["min_heap"] = heap.minimum_free_bytes;
+	tele["max_block"] = heap.largest_free_block;
+	tele["alloc_ct"] = heap.allocated_blocks;
+	// Fragmentation: share of free memory that is not part of the largest free block
+	if (heap.total_free_bytes > 0) {
+		tele["frag"] = 100 - (int)((uint64_t)heap.largest_free_block * 100 / heap.total_free_bytes);
+	}
+	if (stackFree > -1) {
+		tele["stack_free"] = stackFree;
+	}
+
+	if (deviceCount > -1) {
+		tele["disc_ct"] = deviceCount;
+	}
+	if (reportCount > -1) {
+		tele["rept_ct"] = reportCount;
+	}
+	if (voltage > -1) {
+		tele["voltage"] = voltage;
+	}
+	if (loopCount > -1) {
+		tele["loop_ct"] = loopCount;
+	}
+	if (powerOn > -1) {
+		tele["power_on"] = powerOn;
+	}
+
+	if (tele.overflowed() || measureJson(tele) >= size) {
+		return false;
+	}
+	serializeJson(tele, buffer, size);
+	return true;
+}
+
+static bool reportDevice(BLEAdvertisedDevice& advertisedDevice, ScanPublisher& publisher) {
+
+		char JSONmessageBuffer[reportBufferSize];
+		float distance;
+		if (!buildReport(advertisedDevice, JSONmessageBuffer, sizeof(JSONmessageBuffer), distance)) {
+			Serial.println("Report too large to send");
+			return false;
+		}
+
+		const char* publishTopic = channel "/" room;
+
+		if (publisher.connected()) {
+			if (maxDistance == 0 || distance < maxDistance) {
+				if (publisher.publish(publishTopic, false, JSONmessageBuffer)) {
+
+			    // Serial.print("Success sending message to topic: "); Serial.println(publishTopic);
+					return true;
+
+			  } else {
+			    Serial.print("Error sending message: ");
+					Serial.println(publishTopic);
+			    Serial.print("Message: ");
+					Serial.println(JSONmessageBuffer);
+					return false;
+			  }
+			} else {
+				char mac_address[13];
+				formatMacAddress(*advertisedDevice.getAddress().getNative(), mac_address);
+				Serial.printf("%s exceeded distance threshold %.2f\n\r", mac_address, distance);
+				return false;
+			}
+
+		} else {
+
+			Serial.println("MQTT disconnected.");
+			publisher.disconnected();
+		}
+		return false;
+}
+
+static bool sendTelemetry(ScanPublisher& publisher, int deviceCount, int reportCount, int voltage, int loopCount, int powerOn) {
+	if (deviceCount > -1) {
+		Serial.printf("devices_discovered: %d\n\r",deviceCount);
+	}
+
+	if (reportCount > -1) {
+		Serial.printf("devices_reported: %d\n\r",reportCount);
+	}
+
+	if (voltage > -1) {
+		Serial.printf("voltage: %d\n\r",voltage);
+	}
+
+	if (loopCount > -1) {
+		Serial.printf("loop_count: %d\n\r",loopCount);
+	}
+
+	if (powerOn > -1) {
+		Serial.printf("power_on: %d\n\r",powerOn);
+	}
+
+	char teleMessageBuffer[telemetryBufferSize];
+	if (!buildTelemetry(teleMessageBuffer, sizeof(teleMessageBuffer), localIp, uxTaskGetStackHighWaterMark(NULL), deviceCount, reportCount, voltage, loopCount, powerOn)) {
+		Serial.println("Telemetry too large to send");
+		return false;
+	}
+
+	if (publisher.publish(telemetryTopic, true, teleMessageBuffer)) {
+		Serial.println("Telemetry sent");
+		return true;
+	} else {
+		Serial.println("Error sending telemetry");
+		return false;
+	}
+}
+
+int reportScan(BLEScanResults& foundDevices, ScanPublisher& publisher, int voltage, int loopCount, int powerOn) {
+	int devicesCount = foundDevices.getCount();
+	if (identityResolver.getKeyCount() > 0) {
+		unsigned long resolveStarted = micros();
+		int resolved = identityResolver.resolve(scannedAddresses, scannedAddressCount);
+		Serial.printf("Resolved %d private addresses in %lu us (%d from cache)\n\r", resolved, micros() - resolveStarted, identityResolver.getCacheHits());
+	}
+	updateClockOffset();
+
+	int devicesReported = 0;
+	if (publisher.connected()) {
+		for (uint32_t i = 0; i < devicesCount; i++) {
+			BLEAdvertisedDevice device = foundDevices.getDevice(i);
+			if (reportDevice(device, publisher)) {
+				devicesReported++;
+			}
+		}
+		publisher.reported();
+		sendTelemetry(publisher, devicesCount, devicesReported, voltage, loopCount, powerOn);
+	} else {
+		Serial.println("Cannot report; mqtt disconnected");
+		publisher.disconnected();
+	}
+	publisher.clearResults(); // Free the scan results even when they could not be reported
+	return devicesReported;
+}
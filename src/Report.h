@@ -0,0 +1,53 @@
+/*
+	Builds and publishes the JSON payloads for each scan: one presence report per advertised device,
+	and the node's telemetry. The MQTT client and BLE scanner are reached through ScanPublisher,
+	so the same code runs in the host soak test under test/soak.
+*/
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <BLEAdvertisedDevice.h>
+#include <BLEScan.h>
+#include "BLEBeacon.h"
+#include "IdentityResolver.h"
+
+static const size_t reportBufferSize = 512;
+static const size_t telemetryBufferSize = 512;
+
+// What reportScan needs from the node: its MQTT client, and the scanner that owns the results
+class ScanPublisher {
+public:
+	virtual ~ScanPublisher() {}
+	virtual bool connected() = 0;
+	virtual bool publish(const char* topic, bool retain, const char* payload) = 0;
+	virtual void disconnected() = 0; // Called when a report can't be sent because MQTT is down
+	virtual void reported() {} // Called once the devices of a scan have been published, before the telemetry
+	virtual void clearResults() = 0;
+};
+
+extern char localIp[16];
+extern ScannedAddress scannedAddresses[maxScanAddresses];
+extern volatile int scannedAddressCount;
+extern long lastUpdateDuration; // Transfer time of the last update, in milliseconds
+extern long lastUpdateGap; // Longest time without a report across the last update and reboot, in milliseconds
+
+// Notes the address and receive time of an advertisement, the first time it is seen in a scan
+void recordScannedAddress(BLEAdvertisedDevice& advertisedDevice);
+ScannedAddress* findScannedAddress(const uint8_t* address);
+
+void formatMacAddress(const uint8_t* address, char* mac); // mac must hold at least 13 chars
+void getProximityUUIDString(BLEBeacon& beacon, char* uuid);
+float calculateDistance(int rssi, int txPower);
+
+// Serializes the report for a device into buffer. Returns false if it did not fit
+bool buildReport(BLEAdvertisedDevice& advertisedDevice, char* buffer, size_t size, float& distance);
+// Serializes the node's telemetry into buffer; stackFree and counts of -1 are left out. Returns false if it did not fit
+bool buildTelemetry(char* buffer, size_t size, const char* ip, int stackFree, int deviceCount, int reportCount, int voltage, int loopCount, int powerOn);
+
+// Reports every device found by a scan, then the node's telemetry, and frees the scan results.
+// voltage, loopCount and powerOn of -1 are left out of the telemetry. Returns the number of devices reported
+int reportScan(BLEScanResults& foundDevices, ScanPublisher& publisher, int voltage, int loopCount, int powerOn);
+
+#endif
@@ -28,11 +28,19 @@ extern "C" {
 #include <BLEScan.h>
 #include <BLEAdvertisedDevice.h>
 #include <AsyncMqttClient.h>
+#define ARDUINOJSON_USE_LONG_LONG 1
 #include <ArduinoJson.h>
 #include <ArduinoOTA.h>
-#include "BLEBeacon.h"
-#include "BLEEddystoneTLM.h"
-#include "BLEEddystoneURL.h"
+#include <HTTPClient.h>
+#include <Update.h>
+#include "rom/miniz.h"
+#include "rom/crc.h"
+#include "esp_ota_ops.h"
+#include "mbedtls/sha256.h"
+#include "esp_timer.h"
+#include "IdentityResolver.h"
+#include "Clock.h"
+#include "Report.h"
 #include "Common_settings.h"
 #include "Settings.h"
 
@@ -41,13 +49,22 @@ Adafruit_BME280 bme; // I2C
 
 static const int scanTime = singleScanTime;
 static const int waitTime = scanInterval;
-static const uint16_t beaconUUID = 0xFEAA;
-#ifdef TxDefault
-static const int defaultTxPower = TxDefault;
+#ifdef ntpServer
+static const char* timeServer = ntpServer;
 #else
-static const int defaultTxPower = -72;
+static const char* timeServer = "pool.ntp.org";
 #endif
-#define ENDIAN_CHANGE_U16(x) ((((x)&0xFF00)>>8) + (((x)&0xFF)<<8))
+#ifdef otaScanTime
+static const int updateScanTime = otaScanTime;
+#else
+static const int updateScanTime = 2;
+#endif
+#ifdef otaScanInterval
+static const int updateWaitTime = otaScanInterval;
+#else
+static const int updateWaitTime = 10;
+#endif
+#define OTA_STATS_MAGIC 0x4F544131
 #ifdef BME280_enable
 static unsigned BME280_status;
 #endif
@@ -69,109 +86,34 @@ AsyncMqttClient mqttClient;
 TimerHandle_t mqttReconnectTimer;
 TimerHandle_t wifiReconnectTimer;
 bool updateInProgress = false;
-String localIp;
+unsigned long updateStarted = 0;
+unsigned long lastReport = 0;
+unsigned long updateGapTail = 0; // Time since the last report when the node rebooted into the new firmware
+bool awaitingReportAfterUpdate = false;
+RTC_NOINIT_ATTR uint32_t rtcUpdateMagic;
+RTC_NOINIT_ATTR uint32_t rtcUpdateDuration;
+RTC_NOINIT_ATTR uint32_t rtcUpdateGap;
+RTC_NOINIT_ATTR uint32_t rtcUpdateGapTail;
+#ifdef otaTopic
+char pendingUpdateUrl[256];
+uint8_t pendingUpdateHash[32]; // SHA-256 the image must match before it is installed
+volatile bool updateRequested = false;
+#endif
 byte retryAttempts = 0;
 unsigned long last = 0;
 unsigned long lastBME280 = 0;
 unsigned long lastSleep = 0;
 BLEScan* pBLEScan;
 TaskHandle_t BLEScan;
-float distance;
-
-String getProximityUUIDString(BLEBeacon beacon) {
-  std::string serviceData = beacon.getProximityUUID().toString().c_str();
-  int serviceDataLength = serviceData.length();
-  String returnedString = "";
-  int i = serviceDataLength;
-  while (i > 0)
-  {
-    if (serviceData[i-1] == '-') {
-      i--;
-    }
-    char a = serviceData[i-1];
-    char b = serviceData[i-2];
-    returnedString += b;
-    returnedString += a;
-
-    i -= 2;
-  }
-
-  return returnedString;
-}
-
-float calculateDistance(int rssi, int txPower) {
-
-	float distFl;
-
-  if (rssi == 0) {
-      return -1.0;
-  }
 
-  if (!txPower) {
-      // somewhat reasonable default value
-      txPower = defaultTxPower;
-  }
-
-	if (txPower > 0) {
-		txPower = txPower * -1;
-	}
-
-  const float ratio = rssi * 1.0 / txPower;
-  if (ratio < 1.0) {
-      distFl = pow(ratio, 10);
-  } else {
-      distFl = (0.89976) * pow(ratio, 7.7095) + 0.111;
-  }
-
-	return round(distFl * 100) / 100;
-
-}
-
-bool sendTelemetry(int deviceCount = -1, int reportCount = -1, int voltage = -1, int loopCount = -1, int powerOn = -1) {
-	StaticJsonDocument<256> tele;
-	tele["room"] = room;
-	tele["ip"] = localIp;
-	tele["hostname"] = WiFi.getHostname();
-	tele["scan_dur"] = scanTime;
-	tele["wait_dur"] = waitTime;
-	tele["max_dist"] = maxDistance;
-
-	if (deviceCount > -1) {
-		Serial.printf("devices_discovered: %d\n\r",deviceCount);
-    tele["disc_ct"] = deviceCount;
-	}
-
-	if (reportCount > -1) {
-		Serial.printf("devices_reported: %d\n\r",reportCount);
-    tele["rept_ct"] = reportCount;
-	}
-
-	if (voltage > -1) {
-		Serial.printf("voltage: %d\n\r",voltage);
-    tele["voltage"] = voltage;
-	}
-
-	if (loopCount > -1) {
-		Serial.printf("loop_count: %d\n\r",loopCount);
-    tele["loop_ct"] = loopCount;
-	}
-
-	if (powerOn > -1) {
-		Serial.printf("power_on: %d\n\r",powerOn);
-    tele["power_on"] = powerOn;
-	}
-
-	char teleMessageBuffer[258];
-	serializeJson(tele, teleMessageBuffer);
-
-	if (mqttClient.publish(telemetryTopic, 0, 1, teleMessageBuffer) == true) {
-		Serial.println("Telemetry sent");
-		return true;
-	} else {
-		Serial.println("Error sending telemetry");
-		return false;
-	}
-}
+#ifdef irkList
+struct IdentityKeyConfig {
+	const char* id;
+	const char* irk;
+};
+static const IdentityKeyConfig identityKeys[] = irkList;
+static_assert(sizeof(identityKeys) / sizeof(identityKeys[0]) <= maxIdentityKeys, "Too many entries in irkList");
+#endif
 
 bool sendBME280() {
 	if (debug) mqttClient.publish(debugTopic, 0, 0, "sendBME280 start");
@@ -179,6 +121,9 @@ bool sendBME280() {
 	BME280["temperature"] = bme.readTemperature();
 	BME280["humidity"] = bme.readHumidity();
 	BME280["pressure"] = bme.readPressure() / 100.0F;
+	if (clockSynced) {
+		BME280["ts"] = epochMillis(esp_timer_get_time());
+	}
 
 	char BME280MessageBuffer[258];
 	serializeJson(BME280, BME280MessageBuffer);
@@ -239,7 +184,7 @@ bool handleWifiDisconnect() {
 void connectToMqtt() {
   Serial.print("Connecting to MQTT with ClientId ");
   Serial.println(hostname);
-	if (WiFi.isConnected() && !updateInProgress) {
+	if (WiFi.isConnected()) {
 		mqttClient.setServer(mqttHost, mqttPort);
 		mqttClient.setWill(availabilityTopic, 0, 1, "DISCONNECTED");
 		mqttClient.setKeepAlive(60);
@@ -254,10 +199,6 @@ void connectToMqtt() {
 
 bool handleMqttDisconnect() {
 	Serial.println("MQTT has been disconnected.");
-	if (updateInProgress) {
-		Serial.println("Not retrying MQTT connection - OTA update in progress");
-		return true;
-	}
 	if (retryAttempts > 10) {
 #ifndef Deep_sleep
 		Serial.println("Too many retries. Restarting");
@@ -266,7 +207,7 @@ bool handleMqttDisconnect() {
 	} else {
 		retryAttempts++;
 	}
-	if (WiFi.isConnected() && !updateInProgress) {
+	if (WiFi.isConnected()) {
 		Serial.println("Starting MQTT reconnect timer");
     if (xTimerReset(mqttReconnectTimer, 0) == pdFAIL) {
 			Serial.println("failed to restart");
@@ -288,9 +229,10 @@ void WiFiEvent(WiFiEvent_t event) {
 					digitalWrite(LED_GPIO, !LED_ON);
 	        Serial.print("IP address: \t");
 	        Serial.println(WiFi.localIP());
-					localIp = WiFi.localIP().toString().c_str();
+					strlcpy(localIp, WiFi.localIP().toString().c_str(), sizeof(localIp));
 					Serial.print("Hostname: \t");
 					Serial.println(WiFi.getHostname());
+					configTime(0, 0, timeServer);
 	        connectToMqtt();
 					if (xTimerIsTimerActive(wifiReconnectTimer) != pdFALSE) {
 						Serial.println("Stopping wifi reconnect timer");
@@ -343,210 +285,164 @@ void onMqttConnect(bool sessionPresent) {
 
 	//sendTelemetry();
 
+#ifdef otaTopic
+	mqttClient.subscribe(otaTopic, 0);
+#endif
 }
 
+#ifdef otaTopic
+// Parses 64 hex digits into a 32-byte digest
+bool parseSha256(const char* hex, uint8_t* digest) {
+	if (strlen(hex) != 64) return false;
+	for (int i = 0; i < 32; i++) {
+		char byte[3] = {hex[i * 2], hex[i * 2 + 1], '\0'};
+		char* end;
+		digest[i] = strtoul(byte, &end, 16);
+		if (*end != '\0' || !isxdigit(byte[0])) return false;
+	}
+	return true;
+}
+
+void onMqttMessage(char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total) {
+	// Retained requests are ignored, otherwise the node would reinstall the image every time it reconnects
+	if (strcmp(topic, otaTopic) != 0 || properties.retain) {
+		return;
+	}
+	// Until loop() has taken its copy, pendingUpdateUrl and pendingUpdateHash still belong to the previous request
+	if (index != 0 || len != total || total >= sizeof(pendingUpdateUrl) || updateRequested || updateInProgress) {
+		Serial.println("Ignoring OTA request");
+		return;
+	}
+	memcpy(pendingUpdateUrl, payload, len);
+	pendingUpdateUrl[len] = '\0';
+	// The payload is "<url> <sha256 of the uncompressed image>"
+	char* separator = strrchr(pendingUpdateUrl, ' ');
+	if (!separator || !parseSha256(separator + 1, pendingUpdateHash)) {
+		Serial.println("Ignoring OTA request without a SHA-256");
+		return;
+	}
+	*separator = '\0';
+	updateRequested = true;
+}
+#endif
+
 void onMqttDisconnect(AsyncMqttClientDisconnectReason reason) {
   Serial.print("Disconnected from MQTT. Reason: ");
   Serial.println(static_cast<uint8_t>(reason));
   handleMqttDisconnect();
 }
 
-bool reportDevice(BLEAdvertisedDevice advertisedDevice) {
+class MyAdvertisedDeviceCallbacks: public BLEAdvertisedDeviceCallbacks {
 
-	// Serial.printf("\n\n");
+	void onResult(BLEAdvertisedDevice advertisedDevice) {
 
-	StaticJsonDocument<500> doc;
+		recordScannedAddress(advertisedDevice);
 
-	String mac_address = advertisedDevice.getAddress().toString().c_str();
-	mac_address.replace(":","");
-	mac_address.toLowerCase();
-	// Serial.print("mac:\t");
-	// Serial.println(mac_address);
-	int rssi = advertisedDevice.getRSSI();
+		digitalWrite(LED_GPIO, LED_ON);
+		vTaskDelay(10 / portTICK_PERIOD_MS);
+		digitalWrite(LED_GPIO, !LED_ON);
 
-	doc["id"] = mac_address;
-	doc["uuid"] = mac_address;
-	doc["rssi"] = rssi;
+	}
 
-	if (advertisedDevice.haveName()){
-		String nameBLE = String(advertisedDevice.getName().c_str());
-		// Serial.print("Name: ");
-		// Serial.println(nameBLE);
-		doc["name"] = nameBLE;
+};
 
-	} else {
-		// doc["name"] = "unknown";
-		// Serial.println("Device name unknown");
-	}
-
-	// Serial.printf("\n\r");
-	// Serial.printf("Advertised Device: %s \n\r", advertisedDevice.toString().c_str());
-	std::string strServiceData = advertisedDevice.getServiceData();
-	 uint8_t cServiceData[100];
-	 strServiceData.copy((char *)cServiceData, strServiceData.length(), 0);
-
-	 if (advertisedDevice.getServiceDataUUID().equals(BLEUUID(beaconUUID))==true) {  // found Eddystone UUID
-		// Serial.printf("is Eddystone: %d %s length %d\n", advertisedDevice.getServiceDataUUID().bitSize(), advertisedDevice.getServiceDataUUID().toString().c_str(),strServiceData.length());
-		if (cServiceData[0]==0x10) {
-			 BLEEddystoneURL oBeacon = BLEEddystoneURL();
-			 oBeacon.setData(strServiceData);
-			 // Serial.printf("Eddystone Frame Type (Eddystone-URL) ");
-			 // Serial.printf(oBeacon.getDecodedURL().c_str());
-			 doc["url"] = oBeacon.getDecodedURL().c_str();
-
-		} else if (cServiceData[0]==0x20) {
-			 BLEEddystoneTLM oBeacon = BLEEddystoneTLM();
-			 oBeacon.setData(strServiceData);
-			 // Serial.printf("Eddystone Frame Type (Unencrypted Eddystone-TLM) \n");
-			 // Serial.printf(oBeacon.toString().c_str());
-		} else {
-			// Serial.println("service data");
-			for (int i=0;i<strServiceData.length();i++) {
-				// Serial.printf("[%X]",cServiceData[i]);
-			}
+void recordReport() {
+	unsigned long now = millis();
+	if (updateInProgress && lastReport > 0 && (long)(now - lastReport) > lastUpdateGap) {
+		lastUpdateGap = now - lastReport;
+	}
+	if (awaitingReportAfterUpdate) {
+		// millis() restarted at boot, so the gap is the time before the reboot plus the uptime so far
+		awaitingReportAfterUpdate = false;
+		if ((long)(updateGapTail + now) > lastUpdateGap) {
+			lastUpdateGap = updateGapTail + now;
 		}
-		// Serial.printf("\n");
-	} else {
-		if (advertisedDevice.haveManufacturerData()==true) {
-			std::string strManufacturerData = advertisedDevice.getManufacturerData();
-
-
-			uint8_t cManufacturerData[100];
-			strManufacturerData.copy((char *)cManufacturerData, strManufacturerData.length(), 0);
-
-			if (strManufacturerData.length()==25 && cManufacturerData[0] == 0x4C  && cManufacturerData[1] == 0x00 ) {
-				BLEBeacon oBeacon = BLEBeacon();
-				oBeacon.setData(strManufacturerData);
-
-				String proximityUUID = getProximityUUIDString(oBeacon);
-
-				distance = calculateDistance(rssi, oBeacon.getSignalPower());
-
-				// Serial.print("RSSI: ");
-				// Serial.print(rssi);
-				// Serial.print("\ttxPower: ");
-				// Serial.print(oBeacon.getSignalPower());
-				// Serial.print("\tDistance: ");
-				// Serial.println(distance);
-
-				int major = ENDIAN_CHANGE_U16(oBeacon.getMajor());
-				int minor = ENDIAN_CHANGE_U16(oBeacon.getMinor());
-
-				doc["major"] = major;
-				doc["minor"] = minor;
-
-				doc["uuid"] = proximityUUID;
-				doc["id"] = proximityUUID + "-" + String(major) + "-" + String(minor);
-				doc["txPower"] = oBeacon.getSignalPower();
-				doc["distance"] = distance;
-
-			} else {
-
-				if (advertisedDevice.haveTXPower()) {
-					distance = calculateDistance(rssi, advertisedDevice.getTXPower());
-					doc["txPower"] = advertisedDevice.getTXPower();
-				} else {
-					distance = calculateDistance(rssi, defaultTxPower);
-				}
-
-				doc["distance"] = distance;
-
-				// Serial.printf("strManufacturerData: %d \n\r",strManufacturerData.length());
-				// TODO: parse manufacturer data
-
-			}
-		 } else {
-
-			if (advertisedDevice.haveTXPower()) {
-				distance = calculateDistance(rssi, advertisedDevice.getTXPower());
-				doc["txPower"] = advertisedDevice.getTXPower();
-				doc["distance"] = distance;
-			} else {
-				distance = calculateDistance(rssi, defaultTxPower);
-				doc["distance"] = distance;
-			}
+		Serial.printf("Presence gap across update: %ld ms\n\r", lastUpdateGap);
+	}
+	lastReport = now;
+}
 
-			// Serial.printf("no Beacon Advertised ServiceDataUUID: %d %s \n\r", advertisedDevice.getServiceDataUUID().bitSize(), advertisedDevice.getServiceDataUUID().toString().c_str());
-		 }
-		}
+void startUpdateTracking() {
+	updateInProgress = true;
+	updateStarted = millis();
+	lastUpdateDuration = -1;
+	lastUpdateGap = lastReport > 0 ? 0 : -1;
+}
 
-		char JSONmessageBuffer[512];
-		serializeJson(doc, JSONmessageBuffer);
+// Keeps the transfer time and presence gap across the reboot into the new firmware, so they can be reported once it's running
+void finishUpdateTracking() {
+	unsigned long now = millis();
+	rtcUpdateDuration = now - updateStarted;
+	rtcUpdateGap = lastUpdateGap > 0 ? lastUpdateGap : 0;
+	rtcUpdateGapTail = lastReport > 0 ? now - lastReport : 0;
+	rtcUpdateMagic = OTA_STATS_MAGIC;
+	Serial.printf("Update transferred in %u ms\n\r", rtcUpdateDuration);
+}
 
-		String publishTopic = String(channel) + "/" + room;
+void restoreUpdateTracking() {
+	if (rtcUpdateMagic == OTA_STATS_MAGIC) {
+		lastUpdateDuration = rtcUpdateDuration;
+		lastUpdateGap = rtcUpdateGap;
+		updateGapTail = rtcUpdateGapTail;
+		awaitingReportAfterUpdate = true;
+	}
+	rtcUpdateMagic = 0;
+}
 
-		if (mqttClient.connected()) {
-			if (maxDistance == 0 || doc["distance"] < maxDistance) {
-				if (mqttClient.publish((char *)publishTopic.c_str(), 0, 0, JSONmessageBuffer) == true) {
+// Publishes scan reports through the MQTT client, and frees the results held by the BLE scanner
+class MqttScanPublisher: public ScanPublisher {
 
-			    // Serial.print("Success sending message to topic: "); Serial.println(publishTopic);
-					return true;
+	bool connected() {
+		return mqttClient.connected();
+	}
 
-			  } else {
-			    Serial.print("Error sending message: ");
-					Serial.println(publishTopic);
-			    Serial.print("Message: ");
-					Serial.println(JSONmessageBuffer);
-					return false;
-			  }
-			} else {
-				Serial.printf("%s exceeded distance threshold %.2f\n\r", mac_address.c_str(), distance);
-				return false;
-			}
+	bool publish(const char* topic, bool retain, const char* payload) {
+		return mqttClient.publish(topic, 0, retain, payload) != 0;
+	}
 
+	void disconnected() {
+		if (xTimerIsTimerActive(mqttReconnectTimer) != pdFALSE) {
+			TickType_t xRemainingTime = xTimerGetExpiryTime( mqttReconnectTimer ) - xTaskGetTickCount();
+			Serial.print("Time remaining: ");
+			Serial.println(xRemainingTime);
 		} else {
-
-			Serial.println("MQTT disconnected.");
-			if (xTimerIsTimerActive(mqttReconnectTimer) != pdFALSE) {
-				TickType_t xRemainingTime = xTimerGetExpiryTime( mqttReconnectTimer ) - xTaskGetTickCount();
-				Serial.print("Time remaining: ");
-				Serial.println(xRemainingTime);
-			} else {
-				handleMqttDisconnect();
-			}
+			handleMqttDisconnect();
 		}
-		return false;
-}
-
-class MyAdvertisedDeviceCallbacks: public BLEAdvertisedDeviceCallbacks {
-
-	void onResult(BLEAdvertisedDevice advertisedDevice) {
+	}
 
-		digitalWrite(LED_GPIO, LED_ON);
-		vTaskDelay(10 / portTICK_PERIOD_MS);
-		digitalWrite(LED_GPIO, !LED_ON);
+	void reported() {
+		recordReport();
+	}
 
+	void clearResults() {
+		pBLEScan->clearResults();
 	}
 
 };
 
+MqttScanPublisher mqttScanPublisher;
+
 void scanForDevices(void * parameter) {
 	while(1) {
 	    voltage += analogRead(VIN_GPIO);
 	    loopCount += 1;
-		if (!updateInProgress && WiFi.isConnected() && (millis() - last > (waitTime * 1000) || last == 0)) {
+		// Keep reporting during an update, but with short, infrequent scans so the radio is mostly free for the transfer
+		int currentScanTime = updateInProgress ? updateScanTime : scanTime;
+		int currentWaitTime = updateInProgress ? updateWaitTime : waitTime;
+		if (WiFi.isConnected() && (millis() - last > (currentWaitTime * 1000) || last == 0)) {
 			powerOn = analogRead(POWER_GPIO);
 	        voltage = voltage / loopCount;
 			Serial.print("Scanning...\t");
-			BLEScanResults foundDevices = pBLEScan->start(scanTime);
-			int devicesCount = foundDevices.getCount();
-	    Serial.printf("Scan done! Devices found: %d\n\r",devicesCount);
-
-			int devicesReported = 0;
-			if (mqttClient.connected()) {
-			  for (uint32_t i = 0; i < devicesCount; i++) {
-					bool included = reportDevice(foundDevices.getDevice(i));
-					if (included) {
-						devicesReported++;
-					}
-				}
+			scannedAddressCount = 0;
+			BLEScanResults foundDevices = pBLEScan->start(currentScanTime);
+	    Serial.printf("Scan done! Devices found: %d\n\r",foundDevices.getCount());
 #ifdef Deep_sleep
-				sendTelemetry(devicesCount, devicesReported, voltage, loopCount, powerOn);
+			reportScan(foundDevices, mqttScanPublisher, voltage, loopCount, powerOn);
 #else
-				sendTelemetry(devicesCount, devicesReported);
+			reportScan(foundDevices, mqttScanPublisher, -1, -1, -1);
 #endif
-				pBLEScan->clearResults();
 #ifdef BME280_enable
+			if (mqttClient.connected()) {
 				if ((millis() - lastBME280 > 30000) && BME280_status) {
 					sendBME280();
 					lastBME280 = millis();
@@ -554,17 +450,8 @@ void scanForDevices(void * parameter) {
 				else {
 					if (debug) mqttClient.publish(debugTopic, 0, 0, "BME280 info not sent");
 				}
-#endif                                                          
-			} else {
-				Serial.println("Cannot report; mqtt disconnected");
-				if (xTimerIsTimerActive(mqttReconnectTimer) != pdFALSE) {
-					TickType_t xRemainingTime = xTimerGetExpiryTime( mqttReconnectTimer ) - xTaskGetTickCount();
-					Serial.print("Time remaining: ");
-					Serial.println(xRemainingTime);
-				} else {
-					handleMqttDisconnect();
-				}
 			}
+#endif
 			loopCount = 0;
 			voltage = 0;
 			last = millis();
@@ -588,16 +475,220 @@ void scanForDevices(void * parameter) {
 	}
 }
 
+void feedWatchdog() {
+	TIMERG0.wdt_wprotect=TIMG_WDT_WKEY_VALUE;
+	TIMERG0.wdt_feed=1;
+	TIMERG0.wdt_wprotect=0;
+}
+
+#ifdef otaTopic
+// Reads one byte of the image, waiting up to 10 seconds for it to arrive
+int readUpdateByte(WiFiClient* stream) {
+	unsigned long started = millis();
+	while (!stream->available()) {
+		if (!stream->connected() || millis() - started > 10000) return -1;
+		feedWatchdog();
+		delay(1);
+	}
+	return stream->read();
+}
+
+// Skips the remainder of a gzip header, after the two magic bytes have been read
+bool skipGzipHeader(WiFiClient* stream) {
+	int header[8];
+	for (int i = 0; i < 8; i++) {
+		header[i] = readUpdateByte(stream);
+		if (header[i] < 0) return false;
+	}
+	int flags = header[1];
+	if (header[0] != 8) return false; // Only deflate is supported
+	if (flags & 0x04) { // FEXTRA
+		int lo = readUpdateByte(stream);
+		int hi = readUpdateByte(stream);
+		if (lo < 0 || hi < 0) return false;
+		for (int i = 0; i < (lo | (hi << 8)); i++) {
+			if (readUpdateByte(stream) < 0) return false;
+		}
+	}
+	for (int field = 0x08; field <= 0x10; field <<= 1) { // FNAME, FCOMMENT
+		if (!(flags & field)) continue;
+		int c;
+		do {
+			c = readUpdateByte(stream);
+			if (c < 0) return false;
+		} while (c != 0);
+	}
+	if (flags & 0x02) { // FHCRC
+		if (readUpdateByte(stream) < 0 || readUpdateByte(stream) < 0) return false;
+	}
+	return true;
+}
+
+// Writes part of the image to flash, adding it to the image hash
+bool writeUpdate(mbedtls_sha256_context* sha, uint8_t* data, size_t length) {
+	mbedtls_sha256_update(sha, data, length);
+	return Update.write(data, length) == length;
+}
+
+// Downloads a firmware image and writes it to the next OTA partition, inflating it on the fly if it is gzipped.
+// The image is only installed if its SHA-256 matches expectedHash
+bool updateFromUrl(const char* url, const uint8_t* expectedHash) {
+	Serial.printf("Downloading update from %s\n\r", url);
+	const esp_partition_t* partition = esp_ota_get_next_update_partition(NULL);
+	HTTPClient http;
+	if (!partition || !http.begin(url)) {
+		Serial.println("Invalid update URL");
+		return false;
+	}
+	http.useHTTP10(true); // No chunked encoding, so the stream carries only the image
+	int httpCode = http.GET();
+	if (httpCode != HTTP_CODE_OK) {
+		Serial.printf("Update download failed: %d\n\r", httpCode);
+		http.end();
+		return false;
+	}
+	int contentLength = http.getSize(); // -1 if the server did not send it; the image then ends when the connection closes
+	if (contentLength > (int)partition->size) {
+		Serial.printf("Update too large: %d bytes, partition holds %u\n\r", contentLength, partition->size);
+		http.end();
+		return false;
+	}
+
+	WiFiClient* stream = http.getStreamPtr();
+	int first = readUpdateByte(stream);
+	int second = readUpdateByte(stream);
+	bool compressed = first == 0x1F && second == 0x8B;
+	if (first < 0 || second < 0 || !Update.begin(compressed || contentLength < 0 ? UPDATE_SIZE_UNKNOWN : contentLength)) {
+		Serial.println("Update begin failed");
+		http.end();
+		return false;
+	}
+
+	startUpdateTracking();
+	mbedtls_sha256_context sha;
+	mbedtls_sha256_init(&sha);
+	mbedtls_sha256_starts(&sha, 0);
+	tinfl_decompressor* inflator = NULL;
+	uint8_t* dictionary = NULL;
+	size_t dictionaryOffset = 0;
+	uint32_t inflatedLength = 0;
+	uint32_t inflatedCrc = 0;
+	uint8_t trailer[8]; // CRC32 and ISIZE of the gzip member, both little-endian
+	size_t trailerLength = 0;
+	int received = 2;
+	bool ok = true;
+	bool done = false;
+
+	if (compressed) {
+		inflator = (tinfl_decompressor*)malloc(sizeof(tinfl_decompressor));
+		dictionary = (uint8_t*)malloc(TINFL_LZ_DICT_SIZE);
+		ok = inflator && dictionary && skipGzipHeader(stream);
+		if (ok) tinfl_init(inflator);
+	} else {
+		uint8_t start[2] = {(uint8_t)first, (uint8_t)second};
+		ok = writeUpdate(&sha, start, 2);
+	}
+
+	uint8_t buffer[1024];
+	unsigned long lastData = millis();
+	while (ok && !done) {
+		feedWatchdog();
+		if (!compressed && received == contentLength) {
+			done = true;
+			break;
+		}
+		size_t available = stream->available();
+		if (available == 0) {
+			if (!stream->connected() || millis() - lastData > 10000) {
+				// Without a length, an uncompressed image ends when the server closes the connection; a stall is a failure
+				done = !compressed && contentLength < 0 && !stream->connected();
+				ok = done;
+				if (!ok) Serial.printf("Update truncated after %d bytes\n\r", received);
+				break;
+			}
+			delay(1);
+			continue;
+		}
+		int length = stream->readBytes(buffer, min(available, sizeof(buffer)));
+		received += length;
+		lastData = millis();
+
+		if (!compressed) {
+			ok = writeUpdate(&sha, buffer, length);
+			continue;
+		}
+
+		size_t consumed = 0;
+		tinfl_status status;
+		do {
+			size_t inBytes = length - consumed;
+			size_t outBytes = TINFL_LZ_DICT_SIZE - dictionaryOffset;
+			status = tinfl_decompress(inflator, buffer + consumed, &inBytes, dictionary, dictionary + dictionaryOffset, &outBytes, TINFL_FLAG_HAS_MORE_INPUT);
+			consumed += inBytes;
+			if (outBytes > 0) {
+				ok = writeUpdate(&sha, dictionary + dictionaryOffset, outBytes);
+				inflatedCrc = crc32_le(inflatedCrc, dictionary + dictionaryOffset, outBytes);
+				inflatedLength += outBytes;
+				dictionaryOffset = (dictionaryOffset + outBytes) & (TINFL_LZ_DICT_SIZE - 1);
+			}
+		} while (ok && (status == TINFL_STATUS_HAS_MORE_OUTPUT || (status == TINFL_STATUS_NEEDS_MORE_INPUT && consumed < (size_t)length)));
+
+		if (status == TINFL_STATUS_DONE) {
+			done = true;
+			trailerLength = min((size_t)length - consumed, sizeof(trailer)); // The trailer starts right after the deflate stream
+			memcpy(trailer, buffer + consumed, trailerLength);
+		} else if (status < 0) {
+			Serial.printf("Update inflate failed: %d\n\r", status);
+			ok = false;
+		}
+	}
+
+	if (ok && compressed) {
+		while (trailerLength < sizeof(trailer)) {
+			int c = readUpdateByte(stream);
+			if (c < 0) break;
+			trailer[trailerLength++] = c;
+		}
+		uint32_t expectedCrc = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((uint32_t)trailer[3] << 24);
+		uint32_t expectedLength = trailer[4] | (trailer[5] << 8) | (trailer[6] << 16) | ((uint32_t)trailer[7] << 24);
+		ok = trailerLength == sizeof(trailer) && expectedLength == inflatedLength && expectedCrc == inflatedCrc;
+		if (!ok) Serial.printf("Update corrupt: inflated %u bytes, gzip trailer says %u\n\r", inflatedLength, expectedLength);
+	}
+
+	free(inflator);
+	free(dictionary);
+	http.end();
+
+	uint8_t hash[32];
+	mbedtls_sha256_finish(&sha, hash);
+	mbedtls_sha256_free(&sha);
+	if (ok && memcmp(hash, expectedHash, sizeof(hash)) != 0) {
+		Serial.println("Update rejected: SHA-256 does not match");
+		ok = false;
+	}
+
+	if (ok && Update.end(true)) {
+		finishUpdateTracking();
+		Serial.println("Update complete; restarting");
+		delay(500);
+		ESP.restart();
+		return true;
+	}
+	Serial.printf("Update failed: %s\n\r", Update.errorString());
+	Update.abort();
+	updateInProgress = false;
+	return false;
+}
+#endif
+
 void configureOTA() {
 	ArduinoOTA
     .onStart([]() {
 			Serial.println("OTA Start");
-			pBLEScan->stop();
-			updateInProgress = true;
-			mqttClient.disconnect(true);
-			xTimerStop(mqttReconnectTimer, 0); // ensure we don't reconnect to MQTT while reconnecting to Wi-Fi
+			startUpdateTracking();
     })
     .onEnd([]() {
+			finishUpdateTracking();
 			updateInProgress = false;
 			digitalWrite(LED_GPIO, !LED_ON);
       Serial.println("\n\rEnd");
@@ -666,10 +757,26 @@ void setup() {
 
   mqttClient.onConnect(onMqttConnect);
   mqttClient.onDisconnect(onMqttDisconnect);
+#ifdef otaTopic
+  mqttClient.onMessage(onMqttMessage);
+#endif
 
   connectToWifi();
 
 	configureOTA();
+	restoreUpdateTracking();
+
+#ifdef HAVE_SNTP_SYNC_CALLBACK
+	sntp_set_time_sync_notification_cb(onTimeSync);
+#endif
+
+#ifdef irkList
+	for (const IdentityKeyConfig& key : identityKeys) {
+		if (!identityResolver.addKey(key.id, key.irk)) {
+			Serial.printf("Ignoring invalid IRK for %s\n\r", key.id);
+		}
+	}
+#endif
 
   BLEDevice::init("");
   pBLEScan = BLEDevice::getScan(); //create new scan
@@ -681,7 +788,7 @@ void setup() {
 	xTaskCreatePinnedToCore(
 		scanForDevices,
 		"BLE Scan",
-		4096,
+		6144,
 		pBLEScan,
 		1,
 		&BLEScan,
@@ -690,8 +797,17 @@ void setup() {
 }
 
 void loop() {
-	TIMERG0.wdt_wprotect=TIMG_WDT_WKEY_VALUE;
-	TIMERG0.wdt_feed=1;
-	TIMERG0.wdt_wprotect=0;
+	feedWatchdog();
 	ArduinoOTA.handle();
+#ifdef otaTopic
+	if (updateRequested) {
+		// Copied before clearing updateRequested, so a new request can't change them during the download
+		char url[sizeof(pendingUpdateUrl)];
+		uint8_t hash[sizeof(pendingUpdateHash)];
+		memcpy(url, pendingUpdateUrl, sizeof(url));
+		memcpy(hash, pendingUpdateHash, sizeof(hash));
+		updateRequested = false;
+		updateFromUrl(url, hash);
+	}
+#endif
 }
@@ -0,0 +1,155 @@
+/*
+	Measures private address resolution throughput with the software AES fallback:
+	50 IRKs against batches of 200 addresses, as a node near a busy street might see.
+
+	Usage: irk_bench [seconds]
+	Exits non-zero if any address resolves to the wrong identity, or if a repeated batch misses the cache.
+*/
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "AesShim.h"
+#include "IdentityResolver.h"
+
+static const int keyCount = 50;
+static const int addressCount = 200;
+
+static char keyIds[keyCount][16];
+static char keyHex[keyCount][33];
+static uint8_t keyBytes[keyCount][16];
+static ScannedAddress addresses[addressCount];
+static int expected[addressCount];
+
+static uint32_t rng = 0x12345678;
+static uint8_t randomByte() {
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng & 0xFF;
+}
+
+// Builds the resolvable private address a device holding key would advertise
+static void makeRpa(const uint8_t key[16], uint8_t address[ESP_BD_ADDR_LEN]) {
+	AesContext aes;
+	uint8_t plaintext[16] = {0};
+	uint8_t ciphertext[16];
+	address[0] = (randomByte() & 0x3F) | 0x40;
+	address[1] = randomByte();
+	address[2] = randomByte();
+	memcpy(&plaintext[13], address, 3);
+	aesInit(&aes);
+	aesSetKey(&aes, key);
+	aesEncrypt(&aes, plaintext, ciphertext);
+	aesFree(&aes);
+	memcpy(&address[3], &ciphertext[13], 3);
+}
+
+static bool checkSpecVectors() {
+	// FIPS-197 appendix C.1
+	const uint8_t key[16] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+	const uint8_t plaintext[16] = {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff};
+	const uint8_t ciphertext[16] = {0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a};
+	uint8_t output[16];
+	AesContext aes;
+	aesInit(&aes);
+	aesSetKey(&aes, key);
+	aesEncrypt(&aes, plaintext, output);
+	aesFree(&aes);
+	if (memcmp(output, ciphertext, 16) != 0) {
+		printf("FAIL: AES-128 does not match FIPS-197\n");
+		return false;
+	}
+
+	// Bluetooth Core Specification, Vol 3, Part H, D.7: ah() with prand 0x708194 gives 0x0dfbaa
+	IdentityResolver resolver;
+	resolver.addKey("spec", "ec0234a357c8ad05341010a60a397d9b");
+	ScannedAddress spec[2] = {
+		{{0x70, 0x81, 0x94, 0x0d, 0xfb, 0xaa}, true, -1, 0},
+		{{0x70, 0x81, 0x94, 0x0d, 0xfb, 0xaa}, false, -1, 0}, // Same bits, but a public address
+	};
+	resolver.resolve(spec, 2);
+	if (spec[0].identity != 0 || spec[1].identity != -1) {
+		printf("FAIL: ah() does not match the Bluetooth specification sample\n");
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char** argv) {
+	double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+
+	if (!checkSpecVectors()) {
+		return 1;
+	}
+
+	IdentityResolver resolver;
+	for (int k = 0; k < keyCount; k++) {
+		for (int i = 0; i < 16; i++) {
+			keyBytes[k][i] = randomByte();
+			sprintf(&keyHex[k][i * 2], "%02x", keyBytes[k][i]);
+		}
+		sprintf(keyIds[k], "phone-%d", k);
+		resolver.addKey(keyIds[k], keyHex[k]);
+	}
+
+	// A quarter of the addresses belong to known phones; the rest are unknown private, random static or public addresses
+	for (int i = 0; i < addressCount; i++) {
+		ScannedAddress* scanned = &addresses[i];
+		scanned->random = true;
+		expected[i] = -1;
+		if (i % 4 == 0) {
+			expected[i] = (i / 4) % keyCount;
+			makeRpa(keyBytes[expected[i]], scanned->address);
+		} else {
+			for (int j = 0; j < ESP_BD_ADDR_LEN; j++) {
+				scanned->address[j] = randomByte();
+			}
+			if (i % 4 == 1) {
+				scanned->address[0] = (scanned->address[0] & 0x3F) | 0x40;
+			} else if (i % 4 == 2) {
+				scanned->address[0] |= 0xC0;
+			} else {
+				scanned->random = false;
+			}
+		}
+	}
+
+	int privateCount = 0;
+	for (int i = 0; i < addressCount; i++) {
+		if (IdentityResolver::isResolvablePrivateAddress(addresses[i])) privateCount++;
+	}
+
+	typedef std::chrono::steady_clock clock;
+	const char* modes[] = {"uncached", "cached"};
+	for (int mode = 0; mode < 2; mode++) {
+		long batches = 0;
+		if (mode == 1) {
+			resolver.resolve(addresses, addressCount); // Warm the cache
+		}
+		clock::time_point started = clock::now();
+		double elapsed = 0;
+		while (elapsed < seconds) {
+			if (mode == 0) {
+				resolver.clearCache();
+			}
+			resolver.resolve(addresses, addressCount);
+			for (int i = 0; i < addressCount; i++) {
+				if (addresses[i].identity != expected[i]) {
+					printf("FAIL: address %d resolved to %d, expected %d\n", i, addresses[i].identity, expected[i]);
+					return 1;
+				}
+			}
+			if (mode == 1 && resolver.getCacheHits() != privateCount) {
+				printf("FAIL: %d of %d private addresses hit the cache on a repeated batch\n", resolver.getCacheHits(), privateCount);
+				return 1;
+			}
+			batches++;
+			elapsed = std::chrono::duration<double>(clock::now() - started).count();
+		}
+		printf("%s: %d IRKs x %d addresses, %ld batches in %.2f s: %.0f batches/s, %.0f resolutions/s (%d cache hits per batch)\n",
+			modes[mode], keyCount, addressCount, batches, elapsed, batches / elapsed, batches * addressCount / elapsed, resolver.getCacheHits());
+	}
+	return 0;
+}
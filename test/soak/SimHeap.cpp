@@ -0,0 +1,189 @@
+#include "SimHeap.h"
+#include <new>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_heap_caps.h"
+
+struct FreeBlock {
+	uint32_t size; // Whole block, including this header
+	uint32_t used;
+	FreeBlock* next; // Only valid while the block is free; free blocks are kept in address order
+};
+
+static const size_t headerSize = 8;
+
+alignas(16) static uint8_t arena[simHeapSize];
+static FreeBlock* freeList = NULL;
+static bool initialized = false;
+static size_t used = 0;
+static size_t peakUsed = 0;
+static size_t everPeakUsed = 0;
+static size_t liveBlocks = 0;
+static unsigned long long allocations = 0;
+
+static void initialize() {
+	freeList = (FreeBlock*)arena;
+	freeList->size = simHeapSize;
+	freeList->used = 0;
+	freeList->next = NULL;
+	initialized = true;
+}
+
+static bool inArena(void* ptr) {
+	return (uint8_t*)ptr >= arena && (uint8_t*)ptr < arena + simHeapSize;
+}
+
+void* simMalloc(size_t size) {
+	if (!initialized) initialize();
+	size_t need = (size + headerSize + 7) & ~(size_t)7;
+	if (need < sizeof(FreeBlock)) need = sizeof(FreeBlock);
+
+	FreeBlock** link = &freeList;
+	while (*link && (*link)->size < need) {
+		link = &(*link)->next;
+	}
+	if (!*link) {
+		return NULL;
+	}
+	FreeBlock* block = *link;
+	if (block->size - need >= sizeof(FreeBlock)) {
+		FreeBlock* rest = (FreeBlock*)((uint8_t*)block + need);
+		rest->size = block->size - need;
+		rest->used = 0;
+		rest->next = block->next;
+		*link = rest;
+		block->size = need;
+	} else {
+		*link = block->next;
+	}
+	block->used = 1;
+
+	used += block->size;
+	liveBlocks++;
+	allocations++;
+	if (used > peakUsed) peakUsed = used;
+	if (used > everPeakUsed) everPeakUsed = used;
+	return (uint8_t*)block + headerSize;
+}
+
+void simFree(void* ptr) {
+	if (!ptr) return;
+	FreeBlock* block = (FreeBlock*)((uint8_t*)ptr - headerSize);
+	if (!block->used) {
+		fprintf(stderr, "simulated heap: double free of %p\n", ptr);
+		abort();
+	}
+	block->used = 0;
+	used -= block->size;
+	liveBlocks--;
+
+	FreeBlock* prev = NULL;
+	FreeBlock* next = freeList;
+	while (next && next < block) {
+		prev = next;
+		next = next->next;
+	}
+	block->next = next;
+	if (next && (uint8_t*)block + block->size == (uint8_t*)next) {
+		block->size += next->size;
+		block->next = next->next;
+	}
+	if (prev && (uint8_t*)prev + prev->size == (uint8_t*)block) {
+		prev->size += block->size;
+		prev->next = block->next;
+	} else if (prev) {
+		prev->next = block;
+	} else {
+		freeList = block;
+	}
+}
+
+void* simRealloc(void* ptr, size_t size) {
+	if (!ptr) return simMalloc(size);
+	FreeBlock* block = (FreeBlock*)((uint8_t*)ptr - headerSize);
+	size_t available = block->size - headerSize;
+	if (size <= available) return ptr;
+	void* moved = simMalloc(size);
+	if (moved) {
+		memcpy(moved, ptr, available);
+		simFree(ptr);
+	}
+	return moved;
+}
+
+void simHeapStats(SimHeapStats* stats) {
+	if (!initialized) initialize();
+	stats->used = used;
+	stats->peakUsed = peakUsed;
+	stats->totalFree = simHeapSize - used;
+	stats->largestFree = 0;
+	stats->freeBlocks = 0;
+	for (FreeBlock* block = freeList; block; block = block->next) {
+		if (block->size - headerSize > stats->largestFree) stats->largestFree = block->size - headerSize;
+		stats->freeBlocks++;
+	}
+	stats->liveBlocks = liveBlocks;
+	stats->allocations = allocations;
+}
+
+void simHeapResetPeak() {
+	peakUsed = used;
+}
+
+void heap_caps_get_info(multi_heap_info_t* info, uint32_t caps) {
+	SimHeapStats stats;
+	simHeapStats(&stats);
+	info->total_free_bytes = stats.totalFree;
+	info->total_allocated_bytes = stats.used;
+	info->largest_free_block = stats.largestFree;
+	info->minimum_free_bytes = simHeapSize - everPeakUsed;
+	info->allocated_blocks = stats.liveBlocks;
+	info->free_blocks = stats.freeBlocks;
+	info->total_blocks = stats.liveBlocks + stats.freeBlocks;
+}
+
+// Everything the test allocates goes through the simulated heap
+
+static void* allocateOrDie(size_t size) {
+	void* ptr = simMalloc(size);
+	if (!ptr) {
+		fprintf(stderr, "simulated heap exhausted allocating %zu bytes\n", size);
+		abort();
+	}
+	return ptr;
+}
+
+void* operator new(size_t size) { return allocateOrDie(size); }
+void* operator new[](size_t size) { return allocateOrDie(size); }
+void operator delete(void* ptr) noexcept { simFree(ptr); }
+void operator delete[](void* ptr) noexcept { simFree(ptr); }
+void operator delete(void* ptr, size_t) noexcept { simFree(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { simFree(ptr); }
+
+extern "C" {
+void __real_free(void* ptr);
+
+void* __wrap_malloc(size_t size) {
+	return simMalloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+	void* ptr = simMalloc(count * size);
+	if (ptr) memset(ptr, 0, count * size);
+	return ptr;
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+	return simRealloc(ptr, size);
+}
+
+void __wrap_free(void* ptr) {
+	if (ptr && !inArena(ptr)) {
+		__real_free(ptr);
+		return;
+	}
+	simFree(ptr);
+}
+}
@@ -0,0 +1,30 @@
+/*
+	A first-fit heap over a fixed arena, standing in for the ESP32's heap in the soak test. The
+	test's operator new/delete and (through the linker's --wrap) malloc/free all land here, so
+	allocation counts, peak use and fragmentation can be measured exactly.
+*/
+#ifndef SIM_HEAP_H
+#define SIM_HEAP_H
+
+#include <stddef.h>
+
+// Roughly what an ESP32 has left for the application with WiFi and BLE running
+static const size_t simHeapSize = 96 * 1024;
+
+struct SimHeapStats {
+	size_t used; // Bytes in allocated blocks, including headers
+	size_t peakUsed; // Highest value of used since the last simHeapResetPeak()
+	size_t totalFree;
+	size_t largestFree;
+	size_t liveBlocks;
+	size_t freeBlocks;
+	unsigned long long allocations; // Total allocations since start
+};
+
+void* simMalloc(size_t size);
+void simFree(void* ptr);
+void* simRealloc(void* ptr, size_t size);
+void simHeapStats(SimHeapStats* stats);
+void simHeapResetPeak();
+
+#endif
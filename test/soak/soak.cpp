@@ -0,0 +1,377 @@
+/*
+	Soak test for the scan -> report -> telemetry loop. Runs the firmware's reportScan (src/Report.cpp,
+	which scanForDevices in main.cpp also calls) with a fake BLE scanner and a fake MQTT client through
+	many scans in virtual time, with every allocation going through SimHeap.
+
+	After a warm-up, metrics are gathered per window of scans: peak heap use, the number of live
+	allocations at the end of a scan, and fragmentation (share of free memory outside the largest
+	free block). The test fails if any later window grows past the first few, or if a report or
+	telemetry message does not fit its buffer.
+
+	Usage: soak [cycles] [--leak-every N]
+	--leak-every leaks a small allocation every N scans, to check that the gate catches it.
+*/
+#include <Arduino.h>
+#include <BLEScan.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "AesShim.h"
+#include "Clock.h"
+#include "IdentityResolver.h"
+#include "Report.h"
+#include "SimHeap.h"
+#include "Common_settings.h"
+#include "Settings.h"
+
+static const int scanSeconds = 10;
+static const int maxDevicesPerScan = 48;
+static const int fixedDeviceCount = 120;
+static const int phoneCount = 20;
+static const int knownPhoneCount = 10; // Phones whose IRK is configured
+static const int64_t rotationMicros = 15LL * 60 * 1000000; // Phones change address every 15 minutes
+static const int maxQueuedPackets = 2 * (maxDevicesPerScan + 1);
+static const int baselineWindows = 3; // The worst scans are rare, so the baseline is the worst of several windows
+static const double peakTolerance = 0.05;
+static const double liveTolerance = 0.05;
+static const size_t liveSlack = 8; // Scans vary in size, so allow a few blocks on top of the tolerance
+static const double fragTolerance = 0.05;
+
+static void* volatile leaked; // Keeps the injected leak from being optimized away
+static uint32_t rng = 0x2545F491;
+static uint32_t randomNumber() {
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+enum DeviceKind { IBeacon, EddystoneURL, EddystoneTLM, NamedDevice, PlainDevice, Phone };
+
+struct DeviceProfile {
+	DeviceKind kind;
+	uint8_t address[ESP_BD_ADDR_LEN];
+	bool random;
+	uint8_t irk[16];
+	int64_t rotation; // Rotation period the phone's current address belongs to
+	uint16_t major;
+	uint16_t minor;
+};
+
+static DeviceProfile devices[fixedDeviceCount + phoneCount];
+static char phoneIds[knownPhoneCount][16];
+static char phoneIrks[knownPhoneCount][33];
+
+static void rotatePhone(DeviceProfile* phone) {
+	AesContext aes;
+	uint8_t plaintext[16] = {0};
+	uint8_t ciphertext[16];
+	phone->address[0] = (randomNumber() & 0x3F) | 0x40;
+	phone->address[1] = randomNumber();
+	phone->address[2] = randomNumber();
+	memcpy(&plaintext[13], phone->address, 3);
+	aesInit(&aes);
+	aesSetKey(&aes, phone->irk);
+	aesEncrypt(&aes, plaintext, ciphertext);
+	aesFree(&aes);
+	memcpy(&phone->address[3], &ciphertext[13], 3);
+}
+
+static void createPopulation() {
+	for (int i = 0; i < fixedDeviceCount + phoneCount; i++) {
+		DeviceProfile* device = &devices[i];
+		for (int j = 0; j < ESP_BD_ADDR_LEN; j++) {
+			device->address[j] = randomNumber();
+		}
+		device->random = false;
+		device->major = randomNumber();
+		device->minor = randomNumber();
+		if (i < 30) {
+			device->kind = IBeacon;
+		} else if (i < 45) {
+			device->kind = EddystoneURL;
+		} else if (i < 55) {
+			device->kind = EddystoneTLM;
+		} else if (i < 80) {
+			device->kind = NamedDevice;
+		} else if (i < fixedDeviceCount) {
+			device->kind = PlainDevice;
+			device->random = i % 2 == 0;
+			if (device->random) device->address[0] |= 0xC0; // Random static address
+		} else {
+			int phone = i - fixedDeviceCount;
+			device->kind = Phone;
+			device->random = true;
+			device->rotation = 0;
+			for (int j = 0; j < 16; j++) {
+				device->irk[j] = randomNumber();
+			}
+			rotatePhone(device);
+			if (phone < knownPhoneCount) {
+				for (int j = 0; j < 16; j++) {
+					sprintf(&phoneIrks[phone][j * 2], "%02x", device->irk[j]);
+				}
+				sprintf(phoneIds[phone], "phone-%d", phone);
+				identityResolver.addKey(phoneIds[phone], phoneIrks[phone]);
+			}
+		}
+	}
+}
+
+static BLEAdvertisedDevice* advertise(DeviceProfile* profile) {
+	BLEAdvertisedDevice* device = new BLEAdvertisedDevice();
+	device->setAddress(BLEAddress(profile->address));
+	device->setAddressType(profile->random ? BLE_ADDR_TYPE_RANDOM : BLE_ADDR_TYPE_PUBLIC);
+	device->setRSSI(-40 - (int)(randomNumber() % 60));
+
+	switch (profile->kind) {
+	case IBeacon: {
+		uint8_t data[25] = {0x4C, 0x00, 0x02, 0x15};
+		memcpy(&data[4], profile->address, ESP_BD_ADDR_LEN);
+		memcpy(&data[10], profile->address, ESP_BD_ADDR_LEN);
+		data[20] = profile->major >> 8;
+		data[21] = profile->major & 0xFF;
+		data[22] = profile->minor >> 8;
+		data[23] = profile->minor & 0xFF;
+		data[24] = (uint8_t)-59;
+		device->setManufacturerData(std::string((char*)data, sizeof(data)));
+		break;
+	}
+	case EddystoneURL: {
+		std::string frame("\x10\xEB\x03", 3);
+		frame += "example.com/beacon";
+		device->setServiceDataUUID(BLEUUID((uint16_t)0xFEAA));
+		device->setServiceData(frame);
+		break;
+	}
+	case EddystoneTLM: {
+		std::string frame(14, '\0');
+		frame[0] = 0x20;
+		device->setServiceDataUUID(BLEUUID((uint16_t)0xFEAA));
+		device->setServiceData(frame);
+		break;
+	}
+	case NamedDevice:
+		device->setName("Mi Band 3");
+		device->setManufacturerData(std::string("\x57\x01\x00\x11\x22\x33\x44\x55\x66", 9));
+		device->setServiceUUID(BLEUUID((uint16_t)0xFEE0));
+		device->setTXPower(-4);
+		break;
+	case PlainDevice:
+		break;
+	case Phone:
+		device->setManufacturerData(std::string("\x4C\x00\x10\x05\x01\x18\x2A\x4F\x9C", 9));
+		device->setTXPower(12);
+		break;
+	}
+	return device;
+}
+
+// Stands in for BLEScan: results live in the scanner, and start() hands back a copy of them
+class FakeScanner {
+public:
+	BLEScanResults start() {
+		scannedAddressCount = 0;
+		int count = randomNumber() % (maxDevicesPerScan + 1);
+		int64_t step = (int64_t)scanSeconds * 1000000 / (count + 1);
+		for (int i = 0; i < count; i++) {
+			hostMicros += step;
+			DeviceProfile* profile = &devices[randomNumber() % (fixedDeviceCount + phoneCount)];
+			if (profile->kind == Phone && hostMicros / rotationMicros != profile->rotation) {
+				profile->rotation = hostMicros / rotationMicros;
+				rotatePhone(profile);
+			}
+			std::string key = BLEAddress(profile->address).toString();
+			if (results.m_vectorAdvertisedDevices.count(key)) {
+				continue; // Already seen in this scan
+			}
+			BLEAdvertisedDevice* device = advertise(profile);
+			results.m_vectorAdvertisedDevices.insert(std::pair<std::string, BLEAdvertisedDevice*>(key, device));
+			BLEAdvertisedDevice callbackCopy = *device; // onResult receives the device by value
+			recordScannedAddress(callbackCopy);
+		}
+		hostMicros += step;
+		return results;
+	}
+
+	void clearResults() {
+		for (std::map<std::string, BLEAdvertisedDevice*>::iterator it = results.m_vectorAdvertisedDevices.begin(); it != results.m_vectorAdvertisedDevices.end(); ++it) {
+			delete it->second;
+		}
+		results.m_vectorAdvertisedDevices.clear();
+	}
+
+private:
+	BLEScanResults results;
+};
+
+// Stands in for AsyncMqttClient: each publish holds a copy of the packet until the broker acknowledges it,
+// which here happens one scan later
+class FakeMqttClient {
+public:
+	FakeMqttClient() : count(0), acknowledged(0) {}
+
+	bool publish(const char* topic, const char* payload) {
+		if (count >= maxQueuedPackets) {
+			return false;
+		}
+		size_t topicLength = strlen(topic);
+		size_t payloadLength = strlen(payload);
+		char* packet = (char*)malloc(topicLength + payloadLength + 5);
+		memcpy(packet + 4, topic, topicLength);
+		memcpy(packet + 4 + topicLength, payload, payloadLength);
+		queue[count++] = packet;
+		return true;
+	}
+
+	// Frees the packets published before the last call
+	void acknowledge() {
+		for (int i = 0; i < acknowledged; i++) {
+			free(queue[i]);
+		}
+		memmove(queue, queue + acknowledged, (count - acknowledged) * sizeof(char*));
+		count -= acknowledged;
+		acknowledged = count;
+	}
+
+private:
+	char* queue[maxQueuedPackets];
+	int count;
+	int acknowledged;
+};
+
+// Connects the firmware's reportScan to the fake scanner and MQTT client. MQTT is down for some scans,
+// so the test also covers freeing results that could not be reported
+class FakePublisher: public ScanPublisher {
+public:
+	FakePublisher(FakeScanner& scanner, FakeMqttClient& mqttClient) : online(true), telemetrySent(0), scanner(scanner), mqttClient(mqttClient) {}
+
+	bool connected() { return online; }
+	bool publish(const char* topic, bool retain, const char* payload) {
+		if (strcmp(topic, telemetryTopic) == 0) telemetrySent++;
+		return mqttClient.publish(topic, payload);
+	}
+	void disconnected() {}
+	void clearResults() { scanner.clearResults(); }
+
+	bool online;
+	long telemetrySent;
+
+private:
+	FakeScanner& scanner;
+	FakeMqttClient& mqttClient;
+};
+
+struct WindowStats {
+	size_t peakUsed;
+	size_t maxLive;
+	double maxFrag;
+	size_t minLargestFree;
+};
+
+static double fragmentation(const SimHeapStats& stats) {
+	return stats.totalFree > 0 ? 1.0 - (double)stats.largestFree / stats.totalFree : 0.0;
+}
+
+int main(int argc, char** argv) {
+	long cycles = 2000000;
+	long leakEvery = 0;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--leak-every") == 0 && i + 1 < argc) {
+			leakEvery = atol(argv[++i]);
+		} else {
+			cycles = atol(argv[i]);
+		}
+	}
+	long window = cycles / 20 > 1000 ? cycles / 20 : 1000;
+	long warmup = window;
+
+	hostMicros = 1000000;
+	createPopulation();
+
+	FakeScanner scanner;
+	FakeMqttClient mqttClient;
+	FakePublisher publisher(scanner, mqttClient);
+	snprintf(localIp, sizeof(localIp), "%s", "192.168.100.100");
+	WindowStats baseline = {0, 0, 0, 0};
+	WindowStats current = {0, 0, 0, (size_t)-1};
+	int windowIndex = 0;
+	long oversized = 0;
+	bool failed = false;
+
+	printf("%8s %10s %10s %9s %9s %12s\n", "window", "scans", "peak_used", "max_live", "max_frag", "min_largest");
+	for (long cycle = 1; cycle <= cycles; cycle++) {
+		BLEScanResults foundDevices = scanner.start();
+
+		// reportScan only logs messages that don't fit, so check each report separately
+		for (int i = 0; i < foundDevices.getCount(); i++) {
+			BLEAdvertisedDevice device = foundDevices.getDevice(i);
+			char JSONmessageBuffer[reportBufferSize];
+			float distance;
+			if (!buildReport(device, JSONmessageBuffer, sizeof(JSONmessageBuffer), distance)) {
+				oversized++;
+			}
+		}
+
+		publisher.online = randomNumber() % 50 != 0;
+		long telemetrySent = publisher.telemetrySent;
+		reportScan(foundDevices, publisher, -1, -1, -1);
+		if (publisher.online && publisher.telemetrySent == telemetrySent) {
+			oversized++;
+		}
+		mqttClient.acknowledge();
+
+		if (leakEvery > 0 && cycle % leakEvery == 0) {
+			leaked = malloc(24);
+		}
+
+		SimHeapStats stats;
+		simHeapStats(&stats);
+		if (stats.liveBlocks > current.maxLive) current.maxLive = stats.liveBlocks;
+		if (fragmentation(stats) > current.maxFrag) current.maxFrag = fragmentation(stats);
+		if (stats.largestFree < current.minLargestFree) current.minLargestFree = stats.largestFree;
+
+		if (cycle % window == 0) {
+			current.peakUsed = stats.peakUsed;
+			printf("%8d %10ld %10zu %9zu %8.1f%% %12zu\n", windowIndex, cycle, current.peakUsed, current.maxLive, current.maxFrag * 100, current.minLargestFree);
+			if (cycle == warmup) {
+				printf("(warm-up)\n");
+			} else if (cycle <= warmup + baselineWindows * window) {
+				if (current.peakUsed > baseline.peakUsed) baseline.peakUsed = current.peakUsed;
+				if (current.maxLive > baseline.maxLive) baseline.maxLive = current.maxLive;
+				if (current.maxFrag > baseline.maxFrag) baseline.maxFrag = current.maxFrag;
+			} else {
+				if (current.peakUsed > baseline.peakUsed * (1 + peakTolerance)) {
+					printf("FAIL: peak heap grew from %zu to %zu bytes\n", baseline.peakUsed, current.peakUsed);
+					failed = true;
+				}
+				if (current.maxLive > baseline.maxLive * (1 + liveTolerance) + liveSlack) {
+					printf("FAIL: live allocations grew from %zu to %zu\n", baseline.maxLive, current.maxLive);
+					failed = true;
+				}
+				if (current.maxFrag > baseline.maxFrag + fragTolerance) {
+					printf("FAIL: fragmentation grew from %.1f%% to %.1f%%\n", baseline.maxFrag * 100, current.maxFrag * 100);
+					failed = true;
+				}
+			}
+			windowIndex++;
+			current.maxLive = 0;
+			current.maxFrag = 0;
+			current.minLargestFree = (size_t)-1;
+			simHeapResetPeak();
+			if (failed) break;
+		}
+	}
+
+	SimHeapStats stats;
+	simHeapStats(&stats);
+	printf("%llu allocations over the run\n", stats.allocations);
+	if (oversized > 0) {
+		printf("FAIL: %ld reports or telemetry messages did not fit their buffers\n", oversized);
+		failed = true;
+	}
+	if (!failed) {
+		printf("PASS\n");
+	}
+	return failed ? 1 : 0;
+}
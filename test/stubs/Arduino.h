@@ -0,0 +1,65 @@
+// Host stand-in for the parts of the Arduino core used by the hardware-independent firmware code
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+typedef uint8_t byte;
+
+// Virtual time, advanced by the host test rather than the wall clock
+extern int64_t hostMicros;
+inline unsigned long millis() { return (unsigned long)(hostMicros / 1000); }
+inline unsigned long micros() { return (unsigned long)hostMicros; }
+
+// Heap-backed like the Arduino String, so its allocations show up in the soak test
+class String {
+public:
+	String(const char* value = "") : buffer(NULL) { assign(value); }
+	String(const String& other) : buffer(NULL) { assign(other.buffer); }
+	~String() { free(buffer); }
+	String& operator=(const String& other) {
+		if (this != &other) assign(other.buffer);
+		return *this;
+	}
+	const char* c_str() const { return buffer; }
+	size_t length() const { return strlen(buffer); }
+	bool concat(const char* value) {
+		size_t size = strlen(buffer) + strlen(value) + 1;
+		char* joined = (char*)malloc(size);
+		snprintf(joined, size, "%s%s", buffer, value);
+		free(buffer);
+		buffer = joined;
+		return true;
+	}
+
+private:
+	void assign(const char* value) {
+		size_t size = strlen(value) + 1;
+		char* copy = (char*)malloc(size);
+		memcpy(copy, value, size);
+		free(buffer);
+		buffer = copy;
+	}
+	char* buffer;
+};
+
+// ArduinoJson's String support refers to this type as well
+class StringSumHelper : public String {
+public:
+	StringSumHelper(const char* value) : String(value) {}
+};
+
+class HardwareSerial {
+public:
+	int printf(const char*, ...) { return 0; }
+	size_t print(const char*) { return 0; }
+	size_t println(const char* = "") { return 0; }
+};
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,112 @@
+// Host stand-in for the ESP32 BLE Arduino advertisement classes. Members mirror the library's
+// (std::string payloads, a vector of service UUIDs), so copies allocate as they do on the device.
+#ifndef BLE_ADVERTISED_DEVICE_H
+#define BLE_ADVERTISED_DEVICE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "esp_bt_defs.h"
+
+class BLEAddress {
+public:
+	BLEAddress() { memset(m_address, 0, ESP_BD_ADDR_LEN); }
+	BLEAddress(const esp_bd_addr_t address) { memcpy(m_address, address, ESP_BD_ADDR_LEN); }
+	esp_bd_addr_t* getNative() { return &m_address; }
+	bool equals(BLEAddress other) { return memcmp(m_address, other.m_address, ESP_BD_ADDR_LEN) == 0; }
+	std::string toString() {
+		char text[18];
+		snprintf(text, sizeof(text), "%02x:%02x:%02x:%02x:%02x:%02x",
+			m_address[0], m_address[1], m_address[2], m_address[3], m_address[4], m_address[5]);
+		return std::string(text);
+	}
+
+private:
+	esp_bd_addr_t m_address;
+};
+
+class BLEUUID {
+public:
+	BLEUUID() : m_bitSize(0) { memset(m_uuid, 0, sizeof(m_uuid)); }
+	BLEUUID(uint16_t uuid) : m_bitSize(16) {
+		memset(m_uuid, 0, sizeof(m_uuid));
+		m_uuid[0] = uuid >> 8;
+		m_uuid[1] = uuid & 0xFF;
+	}
+	BLEUUID(const uint8_t* data, size_t size) : m_bitSize(128) {
+		memset(m_uuid, 0, sizeof(m_uuid));
+		memcpy(m_uuid, data, size < sizeof(m_uuid) ? size : sizeof(m_uuid));
+	}
+	bool equals(BLEUUID other) {
+		return m_bitSize == other.m_bitSize && memcmp(m_uuid, other.m_uuid, sizeof(m_uuid)) == 0;
+	}
+	int bitSize() { return m_bitSize; }
+	std::string toString() {
+		if (m_bitSize == 0) {
+			return "<NULL>";
+		}
+		char text[37];
+		if (m_bitSize == 16) {
+			snprintf(text, sizeof(text), "0000%02x%02x-0000-1000-8000-00805f9b34fb", m_uuid[0], m_uuid[1]);
+		} else {
+			int length = 0;
+			for (int i = 0; i < 16; i++) {
+				if (i == 4 || i == 6 || i == 8 || i == 10) text[length++] = '-';
+				length += snprintf(text + length, sizeof(text) - length, "%02x", m_uuid[i]);
+			}
+		}
+		return std::string(text);
+	}
+
+private:
+	uint8_t m_uuid[16];
+	int m_bitSize;
+};
+
+class BLEAdvertisedDevice {
+public:
+	BLEAdvertisedDevice()
+		: m_addressType(BLE_ADDR_TYPE_PUBLIC), m_rssi(0), m_txPower(0),
+		m_haveName(false), m_haveManufacturerData(false), m_haveTXPower(false) {}
+
+	BLEAddress getAddress() { return m_address; }
+	esp_ble_addr_type_t getAddressType() { return m_addressType; }
+	int getRSSI() { return m_rssi; }
+	bool haveName() { return m_haveName; }
+	std::string getName() { return m_name; }
+	bool haveManufacturerData() { return m_haveManufacturerData; }
+	std::string getManufacturerData() { return m_manufacturerData; }
+	std::string getServiceData() { return m_serviceData; }
+	BLEUUID getServiceDataUUID() { return m_serviceDataUUID; }
+	bool haveTXPower() { return m_haveTXPower; }
+	int8_t getTXPower() { return m_txPower; }
+
+	// Set by the scan in the library; public here so the host tests can build advertisements
+	void setAddress(BLEAddress address) { m_address = address; }
+	void setAddressType(esp_ble_addr_type_t type) { m_addressType = type; }
+	void setRSSI(int rssi) { m_rssi = rssi; }
+	void setName(std::string name) { m_name = name; m_haveName = true; }
+	void setManufacturerData(std::string data) { m_manufacturerData = data; m_haveManufacturerData = true; }
+	void setServiceData(std::string data) { m_serviceData = data; }
+	void setServiceDataUUID(BLEUUID uuid) { m_serviceDataUUID = uuid; }
+	void setServiceUUID(BLEUUID uuid) { m_serviceUUIDs.push_back(uuid); }
+	void setTXPower(int8_t txPower) { m_txPower = txPower; m_haveTXPower = true; }
+
+private:
+	BLEAddress m_address;
+	esp_ble_addr_type_t m_addressType;
+	int m_rssi;
+	int8_t m_txPower;
+	bool m_haveName;
+	bool m_haveManufacturerData;
+	bool m_haveTXPower;
+	std::string m_name;
+	std::string m_manufacturerData;
+	std::string m_serviceData;
+	BLEUUID m_serviceDataUUID;
+	std::vector<BLEUUID> m_serviceUUIDs;
+};
+
+#endif
@@ -0,0 +1,33 @@
+// Host stand-in for the iBeacon parser of the ESP32 BLE Arduino library
+#ifndef BLE_BEACON_H
+#define BLE_BEACON_H
+
+#include <string>
+#include "BLEAdvertisedDevice.h"
+
+class BLEBeacon {
+public:
+	BLEBeacon() { memset(&m_beaconData, 0, sizeof(m_beaconData)); }
+	void setData(std::string data) {
+		if (data.length() == sizeof(m_beaconData)) {
+			memcpy(&m_beaconData, data.data(), sizeof(m_beaconData));
+		}
+	}
+	BLEUUID getProximityUUID() { return BLEUUID(m_beaconData.proximityUUID, 16); }
+	uint16_t getMajor() { return m_beaconData.major; }
+	uint16_t getMinor() { return m_beaconData.minor; }
+	int8_t getSignalPower() { return m_beaconData.signalPower; }
+
+private:
+	struct {
+		uint16_t manufacturerId;
+		uint8_t subType;
+		uint8_t subTypeLength;
+		uint8_t proximityUUID[16];
+		uint16_t major;
+		uint16_t minor;
+		int8_t signalPower;
+	} __attribute__((packed)) m_beaconData;
+};
+
+#endif
@@ -0,0 +1,15 @@
+// Host stand-in for the Eddystone-TLM parser of the ESP32 BLE Arduino library
+#ifndef BLE_EDDYSTONE_TLM_H
+#define BLE_EDDYSTONE_TLM_H
+
+#include <string>
+
+class BLEEddystoneTLM {
+public:
+	void setData(std::string data) { m_data = data; }
+
+private:
+	std::string m_data;
+};
+
+#endif
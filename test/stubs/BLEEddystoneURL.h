@@ -0,0 +1,24 @@
+// Host stand-in for the Eddystone-URL parser of the ESP32 BLE Arduino library
+#ifndef BLE_EDDYSTONE_URL_H
+#define BLE_EDDYSTONE_URL_H
+
+#include <string>
+
+class BLEEddystoneURL {
+public:
+	void setData(std::string data) { m_data = data; }
+	std::string getDecodedURL() {
+		static const char* schemes[] = {"http://www.", "https://www.", "http://", "https://"};
+		if (m_data.length() < 4) {
+			return "";
+		}
+		std::string url = schemes[(uint8_t)m_data[2] & 0x03];
+		url += m_data.substr(3);
+		return url;
+	}
+
+private:
+	std::string m_data;
+};
+
+#endif
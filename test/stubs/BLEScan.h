@@ -0,0 +1,24 @@
+// Host stand-in for the scan results of the ESP32 BLE Arduino library; the host tests fill them in
+#ifndef BLE_SCAN_H
+#define BLE_SCAN_H
+
+#include <map>
+#include <string>
+#include "BLEAdvertisedDevice.h"
+
+class BLEScanResults {
+public:
+	int getCount() { return m_vectorAdvertisedDevices.size(); }
+	BLEAdvertisedDevice getDevice(uint32_t i) {
+		std::map<std::string, BLEAdvertisedDevice*>::iterator it = m_vectorAdvertisedDevices.begin();
+		for (uint32_t skipped = 0; skipped < i; skipped++) {
+			++it;
+		}
+		return *it->second;
+	}
+
+	// Keyed by address string, owning the devices, as in the library
+	std::map<std::string, BLEAdvertisedDevice*> m_vectorAdvertisedDevices;
+};
+
+#endif
@@ -0,0 +1,2 @@
+// Host builds use the settings templates as they ship
+#include "Common_settings-rename.h"
@@ -0,0 +1,10 @@
+// Host stand-in for esp_timer, driven by the host test's virtual clock
+#ifndef ESP_TIMER_H
+#define ESP_TIMER_H
+
+#include <stdint.h>
+
+extern int64_t hostMicros;
+inline int64_t esp_timer_get_time() { return hostMicros; }
+
+#endif
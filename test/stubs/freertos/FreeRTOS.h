@@ -0,0 +1,16 @@
+// Host stand-in for the FreeRTOS types used by the hardware-independent firmware code
+#ifndef FREERTOS_H
+#define FREERTOS_H
+
+#include <stdint.h>
+
+typedef void* TaskHandle_t;
+typedef uint32_t UBaseType_t;
+
+// The host tests are single-threaded, so critical sections have nothing to exclude
+typedef struct { uint32_t owner; } portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0}
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
+
+#endif
@@ -0,0 +1,9 @@
+// Host stand-in for FreeRTOS tasks; the host tests run on a single thread with no task stack to measure
+#ifndef FREERTOS_TASK_H
+#define FREERTOS_TASK_H
+
+#include "FreeRTOS.h"
+
+inline UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t) { return 2048; }
+
+#endif
@@ -0,0 +1,4 @@
+#include <Arduino.h>
+
+int64_t hostMicros = 0;
+HardwareSerial Serial;